@@ -1,4 +1,5 @@
 #include <Servo.h>
+#include <EEPROM.h>
 
 const int ROWS = 4;
 const int COLS = 3;
@@ -27,92 +28,175 @@ int pos_UD_height_touch;
 
 int current_size = 's';
 
-int mov_LR_size = 12;
-int mov_FB_size = 12;
-int mov_size_offset = 0;
-
 int mov_speed = 500;
 
+// Calibración: ángulos absolutos de cada tecla para cada tamaño, guardados en la EEPROM
+struct KeyAngles {
+  byte lr;
+  byte fb;
+  byte touch;  // Altura de myservo_UD a la que el lápiz toca la tecla
+};
+const int SIZES = 3;
+const byte CALIBRATION_MAGIC = 0x4b;
+const byte CALIBRATION_VERSION = 2;  // La versión 1 no tenía perfiles de pulsación
+const int CALIBRATION_ADDRESS = 2;  // Después de la marca y la versión
+KeyAngles calibration[SIZES][ROWS][COLS];
+
+// Perfil trapezoidal de la pulsación: acelera, baja rápido, frena y recorre despacio los últimos
+// grados hasta tocar; luego sube rápido frenando antes de llegar arriba
+struct PressProfile {
+  byte max_step;      // Grados por tick a toda velocidad
+  byte accel;         // Cuánto crece o decrece el paso en cada tick
+  byte tick_ms;       // Duración de un tick rápido
+  byte slow_degrees;  // Grados antes de tocar que se recorren de uno en uno
+  byte slow_ms;       // Duración de cada grado lento
+};
+const int PROFILES_ADDRESS = CALIBRATION_ADDRESS + sizeof(calibration);
+PressProfile profiles[SIZES][ROWS];
+const PressProfile* profile;  // Perfil de la pulsación en curso
+int velocity = 0;             // Paso del tick anterior, en grados
+
 int start = 1;
 
-void set_size_s() {
-  previous_pos_UD = pos_UD;
-  previous_pos_LR = pos_LR;
-  previous_pos_FB = pos_FB;
+// Cola de comandos: los tokens recibidos mientras el robot se mueve esperan aquí
+const int QUEUE_SIZE = 16;
+const int TOKEN_SIZE = 24;  // Cabe el token de calibración más largo, "kps1=30,30,100,30,100"
+char command_queue[QUEUE_SIZE][TOKEN_SIZE];
+int queue_head = 0;
+int queue_count = 0;
+char token[TOKEN_SIZE];
+int token_len = 0;
+bool token_too_long = false;  // El token en curso no cupo en token y se descarta
+
+// Máquina de estados del movimiento: cada paso escribe los servos y espera sin delay()
+enum State { IDLE, MOVING, PRESS_DOWN, PRESS_UP, PRESS_END, SIZING };
+State state = IDLE;
+unsigned long step_time = 0;  // Cuándo termina la espera del paso actual
+char movements[10];
+int movement_index = 0;  // Pasos de movements ya aplicados, -1 cuando el brazo ya está sobre la tecla
+
+// Un paso del cambio de tamaño: escribe un ángulo y espera
+struct SizeStep {
+  Servo* servo;
+  int angle;  // RESTORE vuelve a la posición de inicio del servo
+  int wait;
+};
+const int RESTORE = -1;
+const SizeStep* size_steps;
+int size_step_count = 0;
+int size_step_index = 0;
 
+void wait_for(unsigned long ms) {
+  step_time = millis() + ms;
+}
+
+const SizeStep size_s_steps[] = {
   // S
-  myservo_FB.write(98);
-  delay(400);
-
-  myservo_LR.write(60);
-  delay(700);
-  myservo_UD.write(75);
-  delay(100);
-  myservo_UD.write(70);
-  delay(100);
-  myservo_UD.write(55);
-  delay(100);
-  myservo_UD.write(90);
-  delay(700);
+  { &myservo_FB, 98, 400 },
+  { &myservo_LR, 60, 700 },
+  { &myservo_UD, 75, 100 },
+  { &myservo_UD, 70, 100 },
+  { &myservo_UD, 55, 100 },
+  { &myservo_UD, 90, 700 },
+  { &myservo_FB, RESTORE, 400 },
+  { &myservo_LR, RESTORE, 400 },
+  { &myservo_UD, RESTORE, 0 }
+};
 
-  myservo_FB.write(pos_FB);
-  delay(400);
-  myservo_LR.write(pos_LR);
-  delay(400);
-  myservo_UD.write(pos_UD);
-}
+const SizeStep size_m_steps[] = {
+  // M
+  { &myservo_UD, 100, 100 },
+  { &myservo_LR, 62, 700 },
+  { &myservo_UD, 80, 100 },
+  { &myservo_UD, 69, 100 },
+  { &myservo_UD, 87, 400 },
+  { &myservo_FB, RESTORE, 700 },
+  { &myservo_FB, RESTORE, 400 },
+  { &myservo_LR, RESTORE, 400 },
+  { &myservo_UD, RESTORE, 0 }
+};
+
+const SizeStep size_b_steps[] = {
+  { &myservo_LR, 65, 700 },
+  { &myservo_UD, 75, 100 },
+  { &myservo_UD, 70, 100 },
+  { &myservo_UD, 66, 100 },
+  { &myservo_UD, 85, 400 },
+  { &myservo_FB, RESTORE, 700 },
+  { &myservo_FB, RESTORE, 400 },
+  { &myservo_LR, RESTORE, 400 },
+  { &myservo_UD, RESTORE, 0 }
+};
 
-void set_size_m() {
+void start_size(const SizeStep* steps, int count) {
   previous_pos_UD = pos_UD;
   previous_pos_LR = pos_LR;
   previous_pos_FB = pos_FB;
 
-  // M
-  myservo_UD.write(100);
-  delay(100);
-  myservo_LR.write(62);
-  delay(700);
-  myservo_UD.write(80);
-  delay(100);
-  myservo_UD.write(69);
-  delay(100);
-  myservo_UD.write(87);
-
-  delay(400);
-  myservo_FB.write(pos_FB);
+  size_steps = steps;
+  size_step_count = count;
+  size_step_index = 0;
+  state = SIZING;
+}
 
-  delay(700);
-  myservo_FB.write(pos_FB);
-  delay(400);
-  myservo_LR.write(pos_LR);
-  delay(400);
-  myservo_UD.write(pos_UD);
+void size_step() {
+  const SizeStep* step = &size_steps[size_step_index++];
+  int angle = step->angle;
+
+  if (angle == RESTORE) {
+    if (step->servo == &myservo_UD) {
+      angle = pos_UD;
+    } else if (step->servo == &myservo_LR) {
+      angle = pos_LR;
+    } else {
+      angle = pos_FB;
+    }
+  }
+  step->servo->write(angle);
+  wait_for(step->wait);
+
+  if (size_step_index == size_step_count) {
+    state = IDLE;
+  }
 }
 
-void set_size_b() {
-  previous_pos_UD = pos_UD;
-  previous_pos_LR = pos_LR;
-  previous_pos_FB = pos_FB;
+int size_index() {
+  if (current_size == 'm') {
+    return 1;
+  } else if (current_size == 'b') {
+    return 2;
+  }
+  return 0;
+}
 
-  myservo_LR.write(65);
-  delay(700);
-  myservo_UD.write(75);
-  delay(100);
-  myservo_UD.write(70);
-  delay(100);
-  myservo_UD.write(66);
-  delay(100);
-  myservo_UD.write(85);
-
-  delay(400);
-  myservo_FB.write(pos_FB);
+// Ángulos de fábrica: pasos de 12 grados desde el 5, que está en LR 90 y FB 110
+void default_calibration() {
+  const byte touch[ROWS] = { 80, 64, 52, 39 };
 
-  delay(700);
-  myservo_FB.write(pos_FB);
-  delay(400);
-  myservo_LR.write(pos_LR);
-  delay(400);
-  myservo_UD.write(pos_UD);
+  for (int s = 0; s < SIZES; s++) {
+    for (int i = 0; i < ROWS; i++) {
+      for (int j = 0; j < COLS; j++) {
+        calibration[s][i][j].lr = 90 - (j - 1) * 12;
+        calibration[s][i][j].fb = 110 - (i - 1) * 12;
+        calibration[s][i][j].touch = touch[i];
+      }
+    }
+    calibration[s][3][0].touch += 2;  // El borrar se presiona dos grados más arriba
+
+    for (int i = 0; i < ROWS; i++) {
+      profiles[s][i] = { 4, 1, 6, 4, 6 };
+    }
+  }
+}
+
+void load_calibration() {
+  default_calibration();
+  if (EEPROM.read(0) == CALIBRATION_MAGIC && EEPROM.read(1) <= CALIBRATION_VERSION) {
+    EEPROM.get(CALIBRATION_ADDRESS, calibration);
+  }
+  if (EEPROM.read(0) == CALIBRATION_MAGIC && EEPROM.read(1) == CALIBRATION_VERSION) {
+    EEPROM.get(PROFILES_ADDRESS, profiles);
+  }
 }
 
 void print_keyboard_matrix() {
@@ -133,16 +217,6 @@ void print_keyboard_matrix() {
 void move_right() {
   Serial.println("move_right");
 
-  if (current_size == 's') {
-    mov_size_offset = 0;
-  } else if (current_size == 'm') {
-    mov_size_offset = 0;
-  } else if (current_size == 'm') {
-    mov_size_offset = 0;
-  }
-  pos_LR = pos_LR - (mov_LR_size + mov_size_offset);
-  myservo_LR.write(pos_LR);
-  delay(mov_speed);
   if (current_position[1] < COLS - 1) {
     current_position[1]++;
   }
@@ -151,18 +225,6 @@ void move_right() {
 void move_left() {
   Serial.println("move_left");
 
-  if (current_size == 's') {
-    mov_size_offset = 0;
-  } else if (current_size == 'm') {
-    mov_size_offset = 0;
-  } else if (current_size == 'b') {
-    mov_size_offset = 0;
-  }
-
-  pos_LR = pos_LR + (mov_LR_size + mov_size_offset);
-
-  myservo_LR.write(pos_LR);
-  delay(mov_speed);
   if (current_position[1] > 0) {
     current_position[1]--;
   }
@@ -171,18 +233,6 @@ void move_left() {
 void move_down() {
   Serial.println("move_down");
 
-  if (current_size == 's') {
-    mov_size_offset = 0;
-  } else if (current_size == 'm') {
-    mov_size_offset = 0;
-  } else if (current_size == 'b') {
-    mov_size_offset = 0;
-  }
-
-  pos_FB = pos_FB - (mov_FB_size + mov_size_offset);
-
-  myservo_FB.write(pos_FB);
-  delay(mov_speed);
   if (current_position[0] < ROWS - 1) {
     current_position[0]++;
   }
@@ -191,16 +241,6 @@ void move_down() {
 void move_up() {
   Serial.println("move_up");
 
-  if (current_size == 's') {
-    mov_size_offset = 0;
-  } else if (current_size == 'm') {
-    mov_size_offset = 0;
-  } else if (current_size == 'b') {
-    mov_size_offset = 0;
-  }
-  pos_FB = pos_FB + (mov_FB_size + mov_size_offset);
-  myservo_FB.write(pos_FB);
-  delay(mov_speed);
   if (current_position[0] > 0) {
     current_position[0]--;
   }
@@ -213,44 +253,72 @@ void press_screen() {
   Serial.print(",");
   Serial.println(current_position[1]);
 
-  if (current_size == 's') {
-    mov_size_offset = 0;
-  } else if (current_size == 'm') {
-    mov_size_offset = 0;
-  } else if (current_size == 'b') {
-    mov_size_offset = 0;
-  }
-
   if (current_position[0] == 3 && current_position[1] == 0) {
     Serial.println("Se presiona el borrar");
-    mov_size_offset = +2;
   }
 
-  if (current_position[0] == 0) {
-    pos_UD_height_touch = 80 + mov_size_offset;  // 78
-  } else if (current_position[0] == 1) {
-    pos_UD_height_touch = 64 + mov_size_offset;
-  } else if (current_position[0] == 2) {
-    pos_UD_height_touch = 52 + mov_size_offset;  // 52
-  } else if (current_position[0] == 3) {
-    pos_UD_height_touch = 39 + mov_size_offset;  // 40
+  pos_UD_height_touch = calibration[size_index()][current_position[0]][current_position[1]].touch;
+  profile = &profiles[size_index()][current_position[0]];
+
+  pos_UD = pos_UD_height_max;
+  velocity = 0;
+  state = PRESS_DOWN;
+}
+
+// Grados que recorre el lápiz hasta detenerse si frena desde un paso dado
+int stopping_distance(int step) {
+  int distance = 0;
+
+  for (; step > 0; step -= profile->accel) {
+    distance += step;
+  }
+  return distance;
+}
+
+// Siguiente paso rápido hacia un punto a distance grados: acelera hasta max_step y frena a tiempo
+int next_step(int distance) {
+  int step = min(velocity + profile->accel, (int)profile->max_step);
+
+  while (step > 1 && stopping_distance(step) > distance) {
+    step--;
   }
+  return min(step, distance);
+}
+
+// Un tick de la pulsación: baja rápido, recorre despacio los últimos grados, toca y sube rápido
+void press_step() {
+  int slow_from = pos_UD_height_touch + profile->slow_degrees;
 
-  for (pos_UD = pos_UD_height_max; pos_UD <= pos_UD_height_max; pos_UD++) {
-    myservo_UD.write(pos_UD);
-    delay(6);
+  if (state == PRESS_END) {
+    print_keyboard_matrix();
+    state = IDLE;
+    return;
   }
 
-  for (pos_UD = pos_UD_height_max; pos_UD >= pos_UD_height_touch; pos_UD--) {
-    myservo_UD.write(pos_UD);
-    delay(6);
+  if (state == PRESS_DOWN) {
+    if (pos_UD > slow_from) {
+      velocity = next_step(pos_UD - slow_from);
+      pos_UD -= velocity;
+      wait_for(profile->tick_ms);
+    } else if (pos_UD > pos_UD_height_touch) {
+      pos_UD--;
+      wait_for(profile->slow_ms);
+    } else {
+      velocity = 0;
+      state = PRESS_UP;
+    }
   }
-  for (pos_UD = pos_UD_height_touch; pos_UD <= pos_UD_height_max; pos_UD++) {
-    myservo_UD.write(pos_UD);
-    delay(6);
+
+  if (state == PRESS_UP) {
+    velocity = next_step(pos_UD_height_max - pos_UD);
+    pos_UD += velocity;
+    wait_for(profile->tick_ms);
+    if (pos_UD >= pos_UD_height_max) {
+      state = PRESS_END;
+    }
   }
 
-  mov_size_offset = 0;
+  myservo_UD.write(pos_UD);
 }
 
 int find_number_position(char number, int* target_pos) {
@@ -266,6 +334,69 @@ int find_number_position(char number, int* target_pos) {
   return 0;
 }
 
+// "kp<tamaño><fila>=<max_step>,<accel>,<tick_ms>,<slow_degrees>,<slow_ms>" cambia el perfil de
+// pulsación de una fila
+void calibrate_profile(const char* text) {
+  char size, row;
+  int max_step, accel, tick_ms, slow_degrees, slow_ms;
+
+  if (sscanf(text, "kp%c%c=%d,%d,%d,%d,%d", &size, &row, &max_step, &accel, &tick_ms, &slow_degrees,
+             &slow_ms) != 7 || strchr("smb", size) == NULL || row < '0' || row >= '0' + ROWS ||
+      max_step < 1 || max_step > 30 || accel < 1 || accel > max_step || tick_ms < 1 || tick_ms > 100 ||
+      slow_degrees < 0 || slow_degrees > 30 || slow_ms < 1 || slow_ms > 100) {
+    Serial.print("Calibration rejected: ");
+    Serial.println(text);
+    return;
+  }
+
+  profiles[size == 's' ? 0 : size == 'm' ? 1 : 2][row - '0'] = { (byte)max_step, (byte)accel, (byte)tick_ms,
+                                                                 (byte)slow_degrees, (byte)slow_ms };
+  Serial.print("Calibrated: ");
+  Serial.println(text);
+}
+
+// Tokens de calibración: "k<tamaño><tecla>=<lr>,<fb>,<altura>" cambia una tecla, "kp..." el perfil
+// de una fila, "kw" guarda todo en la EEPROM y "kd" vuelve a los valores de fábrica. Toda respuesta
+// empieza con "Calibrat".
+void calibrate(const char* text) {
+  char size, key;
+  int lr, fb, touch;
+  int position[2];
+
+  if (strcmp(text, "kw") == 0) {
+    EEPROM.update(0, CALIBRATION_MAGIC);
+    EEPROM.update(1, CALIBRATION_VERSION);
+    EEPROM.put(CALIBRATION_ADDRESS, calibration);
+    EEPROM.put(PROFILES_ADDRESS, profiles);
+    Serial.println("Calibration saved");
+    return;
+  }
+  if (strcmp(text, "kd") == 0) {
+    default_calibration();
+    Serial.println("Calibration reset");
+    return;
+  }
+  if (text[1] == 'p') {
+    calibrate_profile(text);
+    return;
+  }
+
+  if (sscanf(text, "k%c%c=%d,%d,%d", &size, &key, &lr, &fb, &touch) != 5 || strchr("smb", size) == NULL ||
+      !find_number_position(key, position) || lr < 0 || lr > 180 || fb < 0 || fb > 180 ||
+      touch < 0 || touch > pos_UD_height_max) {
+    Serial.print("Calibration rejected: ");
+    Serial.println(text);
+    return;
+  }
+
+  KeyAngles* angles = &calibration[size == 's' ? 0 : size == 'm' ? 1 : 2][position[0]][position[1]];
+  angles->lr = lr;
+  angles->fb = fb;
+  angles->touch = touch;
+  Serial.print("Calibrated: ");
+  Serial.println(text);
+}
+
 void get_movement(int target_pos[2], char* movements, int max_movements) {
   int dx = target_pos[1] - current_position[1];
   int dy = target_pos[0] - current_position[0];
@@ -318,6 +449,7 @@ void move_to_start(){
 
 void setup() {
   Serial.begin(9600);
+  load_calibration();
   Serial.println("------------------------- STARTED -------------------------");
   print_keyboard_matrix();
 
@@ -331,78 +463,144 @@ void setup() {
   myservo_FB.write(pos_FB);
 }
 
+// Lee lo que haya llegado sin esperar y encola cada token terminado en espacio. Un token que no
+// cabe en TOKEN_SIZE solo puede ser de calibración, así que se rechaza en vez de cortarlo.
+void read_serial() {
+  while (queue_count < QUEUE_SIZE && Serial.available()) {
+    char c = Serial.read();
+
+    if (c == ' ') {
+      token[token_len] = '\0';
+      if (token_too_long) {
+        Serial.print("Calibration rejected: ");
+        Serial.print(token);
+        Serial.println("... (too long)");
+      } else {
+        strcpy(command_queue[(queue_head + queue_count) % QUEUE_SIZE], token);
+        queue_count++;
+      }
+      token_len = 0;
+      token_too_long = false;
+    } else if (token_len < TOKEN_SIZE - 1) {
+      token[token_len++] = c;
+    } else {
+      token_too_long = true;
+    }
+  }
+}
+
+void start_command(String target_number) {
+  // Set size to small
+  if (target_number.equals("s\n")) {
+    Serial.print("Size changed to: ");
+    Serial.println(target_number);
+    target_number.trim();
+    current_size = 's';
+    move_to_start();
+    wait_for(500);
+    start_size(size_s_steps, sizeof(size_s_steps) / sizeof(SizeStep));
+
+    // Set size to medium
+  } else if (target_number.equals("m\n")) {
+    Serial.print("Size changed to: ");
+    Serial.println(target_number);
+    target_number.trim();
+    current_size = 'm';
+    move_to_start();
+    wait_for(500);
+    start_size(size_m_steps, sizeof(size_m_steps) / sizeof(SizeStep));
+    // Set size to big
+  } else if (target_number.equals("b\n")) {
+    Serial.print("Size changed to: ");
+    Serial.println(target_number);
+    target_number.trim();
+    current_size = 'b';
+    move_to_start();
+    wait_for(500);
+    start_size(size_b_steps, sizeof(size_b_steps) / sizeof(SizeStep));
+  } else if (target_number[0] == 'k') {
+    calibrate(target_number.c_str());
+  } else {
+
+    Serial.print("Number to be pressed: ");
+    Serial.println(target_number);
+    target_number.trim();
+
+    int target_position[2];
+    if (!find_number_position(target_number[0], target_position)) {
+      Serial.println("Target number not found. Please try again.");
+      return;
+    }
+
+    get_movement(target_position, movements, sizeof(movements) / sizeof(char));
+    movement_index = 0;
+    wait_for(0);
+    state = MOVING;
+  }
+}
+
+// Los pasos solo siguen la posición: los dos ejes van juntos a los ángulos calibrados de la
+// tecla, así que cada traslado espera un solo asentamiento de los servos. Los ángulos se escriben
+// aunque no haya pasos, porque tras arrancar, cambiar de tamaño o recalibrar la tecla actual el
+// brazo puede no estar en ellos.
+void move_step() {
+  if (movement_index < 0) {
+    press_screen();
+    return;
+  }
+
+  for (movement_index = 0; movements[movement_index] != '\0'; movement_index++) {
+    char movement = movements[movement_index];
+
+    if (movement == 'r') {
+      move_right();
+    } else if (movement == 'l') {
+      move_left();
+    } else if (movement == 'd') {
+      move_down();
+    } else if (movement == 'u') {
+      move_up();
+    }
+  }
+
+  movement_index = -1;
+
+  KeyAngles* key = &calibration[size_index()][current_position[0]][current_position[1]];
+  if (pos_LR == key->lr && pos_FB == key->fb) {
+    press_screen();
+    return;
+  }
+
+  pos_LR = key->lr;
+  pos_FB = key->fb;
+  myservo_LR.write(pos_LR);
+  myservo_FB.write(pos_FB);
+  wait_for(mov_speed);
+}
+
 void loop() {
 
   if (start) {
-    if (Serial.available()) {
-      String target_number = Serial.readStringUntil(' ');
-      mov_size_offset = 0;
-
-      // Set size to small
-      if (target_number.equals("s\n")) {
-        Serial.print("Size changed to: ");
-        Serial.println(target_number);
-        target_number.trim();
-        current_size = 's';
-        mov_LR_size = 12;
-        mov_FB_size = 12;
-        move_to_start();
-        delay(500);
-        set_size_s();
-
-        // Set size to medium
-      } else if (target_number.equals("m\n")) {
-        Serial.print("Size changed to: ");
-        Serial.println(target_number);
-        target_number.trim();
-        current_size = 'm';
-        mov_LR_size = 12;
-        mov_FB_size = 12;
-        move_to_start();
-        delay(500);
-        set_size_m();
-        // Set size to big
-      } else if (target_number.equals("b\n")) {
-        Serial.print("Size changed to: ");
-        Serial.println(target_number);
-        target_number.trim();
-        current_size = 'b';
-        mov_LR_size = 12;
-        mov_FB_size = 12;
-        move_to_start();
-        delay(500);
-        set_size_b();
-      } else {
+    // La entrada se sigue leyendo mientras el robot se mueve
+    read_serial();
 
-        Serial.print("Number to be pressed: ");
-        Serial.println(target_number);
-        target_number.trim();
-
-        int target_position[2];
-        if (!find_number_position(target_number[0], target_position)) {
-          Serial.println("Target number not found. Please try again.");
-          return;
-        }
-
-        char movements[10];
-        get_movement(target_position, movements, sizeof(movements) / sizeof(char));
-
-        for (int i = 0; movements[i] != '\0'; i++) {
-          if (movements[i] == 'r') {
-            move_right();
-          } else if (movements[i] == 'l') {
-            move_left();
-          } else if (movements[i] == 'd') {
-            move_down();
-          } else if (movements[i] == 'u') {
-            move_up();
-          }
-        }
-
-        press_screen();
-
-        print_keyboard_matrix();
+    if (state != IDLE && (long)(millis() - step_time) < 0) {
+      return;
+    }
+
+    if (state == IDLE) {
+      if (queue_count > 0) {
+        String target_number = command_queue[queue_head];
+        queue_head = (queue_head + 1) % QUEUE_SIZE;
+        queue_count--;
+        start_command(target_number);
       }
+    } else if (state == MOVING) {
+      move_step();
+    } else if (state == SIZING) {
+      size_step();
+    } else {
+      press_step();
     }
   }
-}
\ No newline at end of file
+}
@@ -0,0 +1,63 @@
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+/* *********************************
+    Host shim of the Arduino core
+************************************ */
+
+typedef uint8_t byte;
+
+unsigned long millis();
+void delay(unsigned long ms);
+
+template <typename T> T min(T a, T b) { return b < a ? b : a; }
+template <typename T> T max(T a, T b) { return a < b ? b : a; }
+
+/**
+ * The subset of Arduino's String the sketch uses.
+ */
+class String
+{
+public:
+    String() {}
+    String(const char *text) : text(text) {}
+    String(const std::string &text) : text(text) {}
+
+    bool equals(const char *other) const { return text == other; }
+    void trim();
+    unsigned int length() const { return text.size(); }
+    const char *c_str() const { return text.c_str(); }
+    char operator[](unsigned int index) const { return index < text.size() ? text[index] : '\0'; }
+
+private:
+    std::string text;
+};
+
+/**
+ * The serial port, backed by the simulator's pty or by the input given on its command line.
+ */
+class HardwareSerial
+{
+public:
+    void begin(unsigned long baud);
+    int available();
+    int read();
+    String readStringUntil(char terminator);
+
+    size_t print(const char *text);
+    size_t print(const String &text) { return print(text.c_str()); }
+    size_t print(char c);
+    size_t print(int value);
+    size_t println() { return print("\r\n"); }
+    template <typename T> size_t println(T value) { return print(value) + println(); }
+};
+
+extern HardwareSerial Serial;
+
+#endif // ARDUINO_H
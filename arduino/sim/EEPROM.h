@@ -0,0 +1,38 @@
+#ifndef EEPROM_H
+#define EEPROM_H
+
+#include "Arduino.h"
+
+#define SIM_EEPROM_SIZE 1024 // An ATmega328P's EEPROM
+
+/**
+ * The Arduino's EEPROM, kept in memory for the life of the simulator; it starts erased.
+ */
+class EEPROMClass
+{
+public:
+    EEPROMClass() { memset(data, 0xff, sizeof(data)); }
+
+    uint8_t read(int address) const { return data[address]; }
+    void write(int address, uint8_t value) { data[address] = value; }
+    void update(int address, uint8_t value) { data[address] = value; }
+    uint16_t length() const { return SIM_EEPROM_SIZE; }
+
+    template <typename T> T &get(int address, T &value) const
+    {
+        memcpy(&value, data + address, sizeof(T));
+        return value;
+    }
+    template <typename T> const T &put(int address, const T &value)
+    {
+        memcpy(data + address, &value, sizeof(T));
+        return value;
+    }
+
+private:
+    uint8_t data[SIM_EEPROM_SIZE];
+};
+
+extern EEPROMClass EEPROM;
+
+#endif // EEPROM_H
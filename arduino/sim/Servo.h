@@ -0,0 +1,21 @@
+#ifndef SERVO_H
+#define SERVO_H
+
+#include "Arduino.h"
+
+/**
+ * A servo whose writes are recorded in the simulator's angle trace.
+ */
+class Servo
+{
+public:
+    uint8_t attach(int pin);
+    void write(int angle);
+    int read() const { return angle; }
+
+private:
+    int pin = -1;  // Pin the servo is attached to
+    int angle = 0; // Last angle written
+};
+
+#endif // SERVO_H
@@ -0,0 +1,368 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "Servo.h"
+
+/* *********************************
+    Variables and Constants
+************************************ */
+
+#define SIM_IDLE_MS 2000       // Virtual time without output or servo writes after which the sketch is idle
+#define SIM_SERIAL_TIMEOUT 1000 // Stream::setTimeout() default: how long readStringUntil() waits
+
+void setup();
+void loop();
+
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+
+static unsigned long sim_now_ms;      // Virtual clock, advanced by delay() and by each loop()
+static unsigned long sim_activity_ms; // Last time the sketch printed or moved a servo
+static unsigned long sim_start_ms;    // When the sketch got input after being idle
+static unsigned long sim_writes;      // Servo writes since then
+static int sim_busy;                  // Whether the sketch got input since it was last idle
+static std::string sim_input;         // Serial bytes the sketch hasn't read yet
+static int sim_master = -1;           // Master side of the pty, -1 when the input came on the command line
+static FILE *sim_trace;               // Servo angle trace, or NULL
+static int sim_echo;                  // Whether the sketch's output is copied to stdout
+
+/* *********************************
+    Arduino core
+************************************ */
+
+/**
+ * @brief Returns the virtual time since the sketch started, in milliseconds.
+ */
+unsigned long millis()
+{
+    return sim_now_ms;
+}
+
+/**
+ * @brief Advances the virtual clock; nothing really waits.
+ */
+void delay(unsigned long ms)
+{
+    sim_now_ms += ms;
+}
+
+/**
+ * @brief Removes leading and trailing whitespace, as String::trim() does.
+ */
+void String::trim()
+{
+    size_t first = 0;
+    size_t last = text.size();
+
+    while (first < last && isspace((unsigned char)text[first]))
+        first++;
+    while (last > first && isspace((unsigned char)text[last - 1]))
+        last--;
+    text = text.substr(first, last - first);
+}
+
+/**
+ * @brief Takes whatever the host wrote to the pty without waiting.
+ */
+static void sim_poll_input()
+{
+    char buf[256];
+    ssize_t num_read;
+
+    if (sim_master < 0)
+        return;
+
+    while ((num_read = read(sim_master, buf, sizeof(buf))) > 0)
+    {
+        if (!sim_busy)
+        {
+            sim_start_ms = sim_now_ms;
+            sim_writes = 0;
+            sim_busy = 1;
+        }
+        sim_input.append(buf, num_read);
+    }
+}
+
+/**
+ * @brief Waits, in real time, for the host to write to the pty.
+ * @return 1 if there is input, 0 on timeout.
+ */
+static int sim_wait_input(int timeout_ms)
+{
+    struct pollfd pfd = {sim_master, POLLIN, 0};
+
+    if (sim_master < 0 || poll(&pfd, 1, timeout_ms) <= 0)
+        return 0;
+
+    sim_poll_input();
+    return !sim_input.empty();
+}
+
+/**
+ * @brief Records that the sketch did something visible.
+ */
+static void sim_active()
+{
+    sim_activity_ms = sim_now_ms;
+}
+
+void HardwareSerial::begin(unsigned long baud)
+{
+    (void)baud;
+}
+
+int HardwareSerial::available()
+{
+    sim_poll_input();
+    return sim_input.size();
+}
+
+int HardwareSerial::read()
+{
+    int c;
+
+    sim_poll_input();
+    if (sim_input.empty())
+        return -1;
+
+    c = (unsigned char)sim_input[0];
+    sim_input.erase(0, 1);
+    return c;
+}
+
+/**
+ * @brief Reads up to a terminator, which is consumed and not returned. Like the real
+ *        one it gives up after SIM_SERIAL_TIMEOUT without new bytes; that wait is real
+ *        time on a pty, and is charged to the virtual clock.
+ */
+String HardwareSerial::readStringUntil(char terminator)
+{
+    struct timespec before, after;
+    std::string text;
+    size_t end;
+
+    while (1)
+    {
+        sim_poll_input();
+        end = sim_input.find(terminator);
+        if (end != std::string::npos)
+        {
+            text += sim_input.substr(0, end);
+            sim_input.erase(0, end + 1);
+            return String(text);
+        }
+
+        text += sim_input;
+        sim_input.clear();
+
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        if (!sim_wait_input(SIM_SERIAL_TIMEOUT))
+        {
+            sim_now_ms += SIM_SERIAL_TIMEOUT;
+            return String(text);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        sim_now_ms += (after.tv_sec - before.tv_sec) * 1000 + (after.tv_nsec - before.tv_nsec) / 1000000;
+    }
+}
+
+size_t HardwareSerial::print(const char *text)
+{
+    size_t len = strlen(text);
+
+    sim_active();
+    if (sim_master >= 0 && write(sim_master, text, len) < 0)
+        perror("Error: Writing to the pty failed\n");
+    if (sim_echo)
+        fwrite(text, 1, len, stdout);
+    return len;
+}
+
+size_t HardwareSerial::print(char c)
+{
+    char text[2] = {c, '\0'};
+
+    return print(text);
+}
+
+size_t HardwareSerial::print(int value)
+{
+    char text[16];
+
+    snprintf(text, sizeof(text), "%d", value);
+    return print(text);
+}
+
+uint8_t Servo::attach(int pin)
+{
+    this->pin = pin;
+    return 1;
+}
+
+void Servo::write(int angle)
+{
+    this->angle = angle;
+    sim_writes++;
+    sim_active();
+    if (sim_trace != NULL)
+        fprintf(sim_trace, "%lu %d %d\n", sim_now_ms, pin, angle);
+}
+
+/* *********************************
+    Simulator
+************************************ */
+
+/**
+ * @brief Opens the pty the host talks to, like it would to the Arduino's USB serial port.
+ * @param link If not NULL, a symlink to the pty is made there.
+ * @return 0 on success, -1 on failure.
+ */
+static int sim_open_pty(const char *link)
+{
+    struct termios tty;
+    const char *name;
+    int slave;
+
+    sim_master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (sim_master < 0 || grantpt(sim_master) < 0 || unlockpt(sim_master) < 0)
+        return -1;
+    name = ptsname(sim_master);
+
+    // Keep the slave open so the master doesn't see a hangup between host connections
+    slave = open(name, O_RDWR | O_NOCTTY);
+    if (slave < 0 || tcgetattr(slave, &tty) < 0)
+        return -1;
+    cfmakeraw(&tty);
+    tcsetattr(slave, TCSANOW, &tty);
+    fcntl(sim_master, F_SETFL, fcntl(sim_master, F_GETFL) | O_NONBLOCK);
+
+    if (link != NULL)
+    {
+        unlink(link);
+        if (symlink(name, link) < 0)
+            return -1;
+    }
+
+    fprintf(stderr, "⭐ Serial port: %s\n", link != NULL ? link : name);
+    return 0;
+}
+
+/**
+ * @brief Turns \n and \r in a command line argument into the bytes they stand for.
+ */
+static std::string sim_unescape(const char *text)
+{
+    std::string out;
+
+    for (; *text != '\0'; text++)
+    {
+        if (text[0] == '\\' && text[1] == 'n')
+            out += '\n', text++;
+        else if (text[0] == '\\' && text[1] == 'r')
+            out += '\r', text++;
+        else
+            out += *text;
+    }
+    return out;
+}
+
+/**
+ * @brief Tells how long the sketch worked on the last input, in virtual time.
+ */
+static void sim_report()
+{
+    fprintf(stderr, "⭐ Done in %lu ms of simulated time, %lu servo writes\n", sim_activity_ms - sim_start_ms,
+            sim_writes);
+    if (sim_trace != NULL)
+        fflush(sim_trace);
+}
+
+/**
+ * @brief Entry point of kpsim, which runs the sketch on the host against simulated
+ *        servos and a virtual clock. With input on the command line, such as
+ *        "d 1 2 3 r " or "m\n ", it feeds it to the sketch, runs until the sketch is
+ *        idle and reports the simulated time. Without it, the sketch's serial port is
+ *        a pty the server or the library can open, and each burst of input is reported.
+ * @param argc The number of command-line arguments.
+ * @param argv An array of strings containing the command-line arguments.
+ *             It may have: [-t trace_file] [-l link] [-v] [input].
+ * @return 0 on success, 1 on incorrect arguments.
+ */
+int main(int argc, char *argv[])
+{
+    const char *link = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:l:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            sim_trace = strcmp(optarg, "-") == 0 ? stdout : fopen(optarg, "w");
+            if (sim_trace == NULL)
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        case 'l':
+            link = optarg;
+            break;
+        case 'v':
+            sim_echo = 1;
+            break;
+        default:
+            fprintf(stderr, "⭐ Usage: %s [-t trace_file] [-l link] [-v] [input]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind < argc)
+        sim_input = sim_unescape(argv[optind]);
+    else if (sim_open_pty(link) < 0)
+    {
+        perror("Error: Opening a pty failed\n");
+        return 1;
+    }
+
+    setup();
+    sim_start_ms = sim_now_ms;
+    sim_writes = 0;
+    sim_busy = !sim_input.empty();
+
+    while (1)
+    {
+        unsigned long before = sim_now_ms;
+
+        loop();
+
+        // A pass of loop() that didn't wait still takes time
+        if (sim_now_ms == before)
+            sim_now_ms++;
+
+        if (!sim_input.empty() || sim_now_ms - sim_activity_ms < SIM_IDLE_MS)
+            continue;
+
+        // The sketch is idle
+        if (sim_busy)
+            sim_report();
+        sim_busy = 0;
+        if (sim_master < 0)
+            return 0;
+
+        while (!sim_wait_input(-1))
+            ;
+    }
+}
@@ -0,0 +1,169 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "colors.h"
+#include "utils.c"
+#include "proto.c"
+#include "command.c"
+
+/* *********************************
+    Parser microbenchmark
+************************************ */
+
+#define BUFFER_SIZE 1024   // Buffer size used by the legacy helpers
+#define ITERATIONS 1000000 // Parses timed per message
+
+/**
+ * @brief The allocating ROT128 the server used before rot128_inplace().
+ */
+static char *legacy_rot128(const char *message)
+{
+    size_t messageLen = strlen(message);
+    char *encrypted = (char *)malloc(messageLen + 1);
+
+    for (size_t i = 0; i < messageLen; ++i)
+    {
+        encrypted[i] = (message[i] + 128) % 256;
+    }
+    encrypted[messageLen] = '\0';
+
+    return encrypted;
+}
+
+/**
+ * @brief The server's former extractDigits().
+ */
+static char *legacy_extractDigits(const char *entry)
+{
+    char *message = (char *)malloc(BUFFER_SIZE * sizeof(char));
+    int j = 0;
+
+    for (int i = 0; entry[i] != '\0'; i++)
+    {
+        if (isdigit(entry[i]) || entry[i] == ' ')
+        {
+            message[j] = entry[i];
+            j++;
+        }
+    }
+    message[j] = '\0';
+
+    return message;
+}
+
+/**
+ * @brief The server's former extractLetters().
+ */
+static char *legacy_extractLetters(const char *entry)
+{
+    char *message = (char *)malloc(BUFFER_SIZE * sizeof(char));
+    int j = 0;
+
+    for (int i = 0; entry[i] != '\0'; i++)
+    {
+        if (isalpha(entry[i]))
+        {
+            message[j] = entry[i];
+            j++;
+        }
+    }
+    message[j] = '\0';
+
+    return message;
+}
+
+/**
+ * @brief The four pass chain: rot128, addSpaces, extractLetters and extractDigits.
+ * @return The number of bytes of the result, so the work cannot be optimized away.
+ */
+static size_t legacy_parse(const char *code)
+{
+    char *encrypted = legacy_rot128(code);
+    char *decrypted = addSpaces(encrypted);
+    char *size = legacy_extractLetters(decrypted);
+    char *digits = NULL;
+    size_t result;
+
+    if (strcmp(size, "s") == 0 || strcmp(size, "m") == 0 || strcmp(size, "b") == 0)
+    {
+        result = strlen(size);
+    }
+    else
+    {
+        digits = legacy_extractDigits(decrypted);
+        result = strlen(digits);
+    }
+
+    free(digits);
+    free(size);
+    free(decrypted);
+    free(encrypted);
+    return result;
+}
+
+/**
+ * @brief Returns the current time in nanoseconds.
+ */
+static double now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @brief Times both parsers on one message and prints the cost per call.
+ * @param label The name printed for the message.
+ * @param plain The message before encryption.
+ */
+static void bench(const char *label, const char *plain)
+{
+    char code[BUFFER_SIZE];
+    struct command cmd;
+    size_t len = strlen(plain);
+    volatile size_t sink = 0;
+    double start, legacy_ns, fused_ns;
+
+    memcpy(code, plain, len + 1);
+    rot128_inplace(code, len);
+
+    start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++)
+        sink += legacy_parse(code);
+    legacy_ns = (now_ns() - start) / ITERATIONS;
+
+    start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        command_parse(code, len, &cmd);
+        sink += cmd.len;
+    }
+    fused_ns = (now_ns() - start) / ITERATIONS;
+
+    bold_white();
+    printf("%-10s", label);
+    default_color();
+    printf(" legacy %8.1f ns   fused %8.1f ns   ", legacy_ns, fused_ns);
+    bold_green();
+    printf("x%.1f", legacy_ns / fused_ns);
+    default_color();
+    printf("\n");
+}
+
+/**
+ * @brief Entry point of the parser microbenchmark.
+ */
+int main()
+{
+    bench("size", "s\n");
+    bench("pin", "1234\n");
+    bench("pin-8", "12345678\n");
+    bench("long", "0123456789012345678901234567890123456789012345678901234567890123\n");
+
+    return 0;
+}
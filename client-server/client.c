@@ -6,11 +6,169 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <ctype.h>
 #include "colors.h"
 #include "utils.c"
+#include "proto.c"
 
 #define BUFFER_SIZE 1024
 
+#define RTO_INITIAL_MS 250   // Retransmission timeout before the first RTT sample
+#define RTO_MIN_MS 20        // Lower bound of the retransmission timeout
+#define RTO_MAX_MS 2000      // Upper bound of the retransmission timeout
+#define SEND_RETRIES 8       // Retransmissions before a command is given up
+#define SEND_BUSY_RETRIES 20 // BUSY replies before a command is given up
+
+/**
+ * Retransmission timer state, computed as in RFC 6298.
+ */
+struct rto_state
+{
+    double srtt;   // Smoothed round-trip time in ms, 0 until the first sample
+    double rttvar; // Round-trip time variation in ms
+    double rto;    // Current retransmission timeout in ms
+};
+
+/**
+ * @brief Returns the current CLOCK_MONOTONIC time in milliseconds.
+ */
+double now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * @brief Updates the retransmission timeout with a round-trip time sample.
+ */
+void rto_sample(struct rto_state *rto, double rtt)
+{
+    if (rto->srtt == 0)
+    {
+        rto->srtt = rtt;
+        rto->rttvar = rtt / 2;
+    }
+    else
+    {
+        rto->rttvar = 0.75 * rto->rttvar + 0.25 * (rto->srtt > rtt ? rto->srtt - rtt : rtt - rto->srtt);
+        rto->srtt = 0.875 * rto->srtt + 0.125 * rtt;
+    }
+
+    rto->rto = rto->srtt + 4 * rto->rttvar;
+    if (rto->rto < RTO_MIN_MS)
+        rto->rto = RTO_MIN_MS;
+    if (rto->rto > RTO_MAX_MS)
+        rto->rto = RTO_MAX_MS;
+}
+
+/**
+ * @brief Reads how long a BUSY reply asks to wait, in milliseconds.
+ */
+double busyDelay(char *reply, ssize_t n, const struct proto_header *answer)
+{
+    uint32_t retry;
+
+    if (answer->length != sizeof(retry) || n != PROTO_HEADER_SIZE + (ssize_t)sizeof(retry))
+        return RTO_MAX_MS;
+
+    rot128_inplace(reply + PROTO_HEADER_SIZE, sizeof(retry));
+    memcpy(&retry, reply + PROTO_HEADER_SIZE, sizeof(retry));
+    return ntohl(retry);
+}
+
+/**
+ * @brief Sends a command and waits for the server to acknowledge it, retransmitting
+ *        with exponential backoff when the datagram or its ack is lost. When the server
+ *        is busy, waits as long as it asks, plus some jitter so clients don't all come
+ *        back at once, and sends the command again.
+ * @param sockfd The socket.
+ * @param servaddr The server address.
+ * @param header The header of the frame; its seq identifies every retransmission.
+ * @param payload The encrypted payload, header->length bytes.
+ * @param rto The retransmission timer, updated with the measured round trip.
+ * @return PROTO_ACK, PROTO_NACK, PROTO_BUSY if the server stayed busy, or -1 if it
+ *         never answered.
+ */
+int sendReliable(int sockfd, const struct sockaddr_in *servaddr, const struct proto_header *header,
+                 const char *payload, struct rto_state *rto)
+{
+    char datagram[PROTO_HEADER_SIZE + PROTO_MAX_PAYLOAD];
+    char reply[BUFFER_SIZE];
+    struct proto_header answer;
+    struct pollfd pfd = {sockfd, POLLIN, 0};
+    size_t datagram_len = proto_encode(datagram, header, payload);
+    double timeout = rto->rto;
+    double sent_at, deadline, delay;
+    int busy = 0;
+    int resend;
+    ssize_t n;
+
+    for (int attempt = 0; attempt <= SEND_RETRIES; attempt++)
+    {
+        sendto(sockfd, datagram, datagram_len, 0, (const struct sockaddr *)servaddr, sizeof(*servaddr));
+        sent_at = now_ms();
+        deadline = sent_at + timeout;
+        resend = 0;
+
+        while (!resend && now_ms() < deadline)
+        {
+            if (poll(&pfd, 1, (int)(deadline - now_ms()) + 1) <= 0)
+                continue;
+
+            n = recv(sockfd, reply, sizeof(reply), 0);
+            if (n < 0 || proto_decode(reply, n, &answer) < 0 || answer.session != header->session)
+                continue;
+
+            if (answer.opcode == PROTO_EXPIRED)
+            {
+                bold_yellow();
+                printf("   ⌛ expired: seq %u, the robot didn't get to it in time\n", answer.seq);
+                default_color();
+                continue;
+            }
+
+            if (answer.seq != header->seq)
+                continue; // Late answer to an earlier command
+
+            // Karn's rule: only a command sent once gives an unambiguous sample
+            if (attempt == 0)
+                rto_sample(rto, now_ms() - sent_at);
+
+            if (answer.opcode != PROTO_BUSY)
+                return answer.opcode == PROTO_NACK ? PROTO_NACK : PROTO_ACK;
+
+            if (++busy > SEND_BUSY_RETRIES)
+                return PROTO_BUSY;
+
+            delay = busyDelay(reply, n, &answer);
+            delay += delay * (rand() % 256) / 1024.0; // Up to 25% jitter
+            bold_yellow();
+            printf("   … busy: retrying in %.0f ms\n", delay);
+            default_color();
+            fflush(stdout);
+            usleep((useconds_t)(delay * 1000));
+
+            // The server answered, so start over as a fresh send
+            attempt = -1;
+            timeout = rto->rto;
+            resend = 1;
+        }
+
+        if (!resend)
+        {
+            timeout = timeout * 2 > RTO_MAX_MS ? RTO_MAX_MS : timeout * 2;
+            rto->rto = timeout;
+        }
+    }
+
+    return -1;
+}
+
 char *extractDigits(const char *entry)
 {
     char *message = (char *)malloc(BUFFER_SIZE * sizeof(char));
@@ -24,24 +182,198 @@ char *extractDigits(const char *entry)
         j++;
         // }
     }
+    message[j] = '\0';
 
     return message;
 }
 
+/**
+ * @brief Reads one operation typed by the user: a single s, m or b changes the size,
+ *        anything else presses its digits.
+ * @param text The operation text.
+ * @param len Its length in bytes.
+ * @param opcode Receives PROTO_PRESS or PROTO_SET_SIZE.
+ * @param out Receives the operation payload, not yet encrypted.
+ * @param room Bytes available at out.
+ * @return The payload length, 0 if the text has nothing to send, or -1 if it has more
+ *         than room keys.
+ */
+long buildOperation(const char *text, size_t len, uint8_t *opcode, char *out, size_t room)
+{
+    const char *letter = NULL;
+    size_t n = 0;
+    int letters = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (isalpha((unsigned char)text[i]))
+        {
+            letter = &text[i];
+            letters++;
+        }
+    }
+
+    if (letters == 1 && strchr("smb", *letter) != NULL && room > 0)
+    {
+        *opcode = PROTO_SET_SIZE;
+        out[0] = *letter == 's' ? PROTO_SIZE_SMALL : *letter == 'm' ? PROTO_SIZE_MEDIUM : PROTO_SIZE_BIG;
+        return 1;
+    }
+
+    *opcode = PROTO_PRESS;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (!isdigit((unsigned char)text[i]))
+            continue;
+        if (n == room)
+            return -1;
+        out[n++] = text[i] - '0';
+    }
+    return n;
+}
+
+/**
+ * @brief Appends an operation to a batch being built, as opcode(1) length(1) payload.
+ *        Keys beyond the 255 an operation holds go in further PRESS operations, which
+ *        the server presses back to back.
+ * @param opcode The operation's opcode.
+ * @param op The operation payload.
+ * @param len Its length in bytes.
+ * @param payload The batch, PROTO_MAX_PAYLOAD bytes.
+ * @param used Bytes of the batch in use, updated.
+ * @return The number of operations appended, or -1 if they don't fit in the frame.
+ */
+int appendOperation(uint8_t opcode, const char *op, size_t len, char *payload, size_t *used)
+{
+    size_t chunk;
+    int ops = 0;
+
+    do
+    {
+        chunk = len < 255 ? len : 255;
+        if (*used + 2 + chunk > PROTO_MAX_PAYLOAD)
+            return -1;
+        payload[*used] = opcode;
+        payload[*used + 1] = (char)chunk;
+        memcpy(payload + *used + 2, op, chunk);
+        *used += 2 + chunk;
+        op += chunk;
+        len -= chunk;
+        ops++;
+    } while (len > 0);
+
+    return ops;
+}
+
+/**
+ * @brief Builds the payload of a frame from a line typed by the user. Operations are
+ *        separated by commas; a line with several becomes a BATCH, and "ping" a PING.
+ * @param entry The line.
+ * @param header Receives the opcode and the payload length.
+ * @param payload Receives the payload, not yet encrypted; PROTO_MAX_PAYLOAD bytes.
+ * @return 0 on success, -1 if the line has nothing to send or doesn't fit in a frame.
+ */
+int buildFrame(const char *entry, struct proto_header *header, char *payload)
+{
+    const char *text = entry;
+    const char *comma;
+    char op[PROTO_MAX_PAYLOAD];
+    size_t text_len, used = 0;
+    long op_len;
+    uint8_t opcode;
+    int appended;
+    int ops = 0;
+
+    if (strncmp(entry, "ping", 4) == 0)
+    {
+        header->opcode = PROTO_PING;
+        header->length = 0;
+        return 0;
+    }
+
+    // Build every operation as a batch entry, opcode(1) length(1) payload
+    while (*text != '\0')
+    {
+        comma = strchr(text, ',');
+        text_len = comma != NULL ? (size_t)(comma - text) : strlen(text);
+        op_len = buildOperation(text, text_len, &opcode, op, sizeof(op));
+        appended = op_len > 0 ? appendOperation(opcode, op, op_len, payload, &used) : 0;
+        if (op_len < 0 || appended < 0)
+        {
+            bold_red();
+            printf("   ✖ too long: it doesn't fit in a frame\n");
+            default_color();
+            return -1;
+        }
+        ops += appended;
+        text += comma != NULL ? text_len + 1 : text_len;
+    }
+
+    if (ops == 0)
+        return -1;
+
+    if (ops == 1)
+    {
+        // A single operation goes without the batch framing
+        header->opcode = (uint8_t)payload[0];
+        used -= 2;
+        memmove(payload, payload + 2, used);
+    }
+    else
+        header->opcode = PROTO_BATCH;
+
+    header->length = used;
+    return 0;
+}
+
+/**
+ * @brief Prints a payload byte by byte, in hexadecimal.
+ */
+void printPayload(const char *label, const char *payload, size_t len)
+{
+    printf("   %s :", label);
+    for (size_t i = 0; i < len; i++)
+        printf(" %02x", (unsigned char)payload[i]);
+    printf("\n");
+}
+
 /**
  * @brief Entry point of the UDP client program.
  * @param argc The number of command-line arguments.
  * @param argv An array of strings containing the command-line arguments.
- *             It should have four elements: <server_ip>, <port>, and <key>.
+ *             It should have: [-t] [-d deadline_ms] <server_ip> <port>. With -t the
+ *             commands are sent in the legacy text format, without acknowledgements.
+ *             With -d the server drops commands the robot can't get to in time.
  * @return 0 on success, 1 on incorrect command-line arguments.
  */
 int main(int argc, char *argv[])
 {
-    if (argc != 3)
+    int legacy = 0;
+    long deadline_ms = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "td:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            legacy = 1;
+            break;
+        case 'd':
+            deadline_ms = atol(optarg);
+            break;
+        default:
+            deadline_ms = -1;
+            break;
+        }
+    }
+
+    if (argc - optind != 2 || deadline_ms < 0 || (deadline_ms + PROTO_TTL_UNIT_MS - 1) / PROTO_TTL_UNIT_MS > UINT16_MAX)
     {
-        printf("Usage: %s <server_ip> <port>\n", argv[0]);
+        printf("Usage: %s [-t] [-d deadline_ms] <server_ip> <port>\n", argv[0]);
         return 1;
     }
+    argv += optind - 1;
 
     int sockfd;
     char buffer[BUFFER_SIZE];
@@ -68,7 +400,16 @@ int main(int argc, char *argv[])
 
     char *code;
     char entry[BUFFER_SIZE];
-    char *encrypted;
+    size_t code_len;
+    struct rto_state rto = {0, 0, RTO_INITIAL_MS};
+    struct proto_header header = {PROTO_MAGIC, PROTO_VERSION, 0, 0, 0, 0, 0, 0, 0};
+    char payload[PROTO_MAX_PAYLOAD];
+    int result;
+
+    // A new session per run, so the server doesn't take our sequence numbers for old ones
+    srand(time(NULL) ^ getpid());
+    header.session = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+    header.ttl = (deadline_ms + PROTO_TTL_UNIT_MS - 1) / PROTO_TTL_UNIT_MS;
 
     while (1)
     {
@@ -77,35 +418,80 @@ int main(int argc, char *argv[])
         printf("\n▶ Type your code: ");
 
         bold_white();
-        fgets(entry, BUFFER_SIZE, stdin);
-
-        // Recordar remover el \n
-        code = extractDigits(entry);
-        if (strlen(code) == 0)
+        if (fgets(entry, BUFFER_SIZE, stdin) == NULL)
         {
-            continue;
+            break;
         }
 
-        bold_green();
-        printf("   ◗ in  : %s\n", addSpaces(code));
+        if (!legacy)
+        {
+            entry[strcspn(entry, "\n")] = '\0';
+            if (buildFrame(entry, &header, payload) < 0)
+            {
+                continue;
+            }
+
+            bold_green();
+            printPayload("in ", payload, header.length);
+
+            // ROT128 encrypt the payload in place
+            rot128_inplace(payload, header.length);
 
-        // ROT128 encrypt the message
-        encrypted = rot128(code);
+            bold_red();
+            printPayload("enc", payload, header.length);
+            default_color();
 
-        if (encrypted == NULL)
+            // Send the frame to the server and wait for it to be acknowledged
+            header.seq++;
+            result = sendReliable(sockfd, &servaddr, &header, payload, &rto);
+        }
+        else
         {
+            // Recordar remover el \n
+            code = extractDigits(entry);
+            if (strlen(code) == 0)
+            {
+                continue;
+            }
+
+            bold_green();
+            printf("   ◗ in  : %s\n", addSpaces(code));
+
+            // ROT128 encrypt the message in place
+            code_len = strlen(code);
+            rot128_inplace(code, code_len);
+
             bold_red();
-            printf("\n⛔ Encryption failed\n");
+            printf("   ◖ enc : %s\n", addSpaces(code));
             default_color();
+
+            // Send the message to the server
+            sendto(sockfd, (const char *)code, code_len, 0, (const struct sockaddr *)&servaddr, sizeof(servaddr));
+            free(code);
             continue;
         }
 
-        bold_red();
-        printf("   ◖ enc : %s\n", addSpaces(encrypted));
+        if (result == PROTO_ACK)
+        {
+            bold_green();
+            printf("   ✔ ack : seq %u (rto %.0f ms)\n", header.seq, rto.rto);
+        }
+        else if (result == PROTO_NACK)
+        {
+            bold_yellow();
+            printf("   ✖ nack: seq %u, no size or keys in it, or more operations than the server queues\n", header.seq);
+        }
+        else if (result == PROTO_BUSY)
+        {
+            bold_red();
+            printf("   ✖ busy: seq %u, the server stayed busy\n", header.seq);
+        }
+        else
+        {
+            bold_red();
+            printf("   ✖ lost: seq %u, the server didn't answer\n", header.seq);
+        }
         default_color();
-
-        // Send the message to the server
-        sendto(sockfd, (const char *)encrypted, strlen(code), 0, (const struct sockaddr *)&servaddr, sizeof(servaddr));
     }
 
     close(sockfd);
@@ -0,0 +1,168 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+
+/* *********************************
+    Client table
+************************************ */
+
+#define CLIENTS_MAX 1024     // Clients tracked at once; the least recently seen is evicted
+#define CLIENTS_WINDOW 64    // Sequence numbers remembered per client for deduplication
+#define CLIENTS_RETIRED 4    // Earlier sessions remembered per client, whose frames are dropped
+
+/**
+ * What the server remembers about a client, keyed by its address.
+ */
+struct client
+{
+    int used;                 // Whether the slot holds a client
+    struct sockaddr_in addr;  // Client address
+    uint32_t session;         // Session of the client's current run
+    uint32_t highest;         // Highest sequence number accepted
+    uint64_t window;          // Bit i set: sequence highest - i was accepted
+    uint32_t retired[CLIENTS_RETIRED]; // Sessions the client ran before, most recent first
+    int retired_count;        // Number of them
+    uint64_t last_seen_ns;    // When the client last sent something
+};
+
+static struct client clients[CLIENTS_MAX];
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Returns the slot where a client should live, from its address.
+ */
+static inline uint32_t clients_hash(const struct sockaddr_in *addr)
+{
+    return (addr->sin_addr.s_addr * 2654435761u ^ addr->sin_port * 40503u) % CLIENTS_MAX;
+}
+
+/**
+ * @brief Finds a client, adding it if it is new. Must be called with clients_lock held.
+ *        Linear probing from the hashed slot; when the table is full, the client seen
+ *        least recently is replaced.
+ */
+static struct client *clients_find(const struct sockaddr_in *addr, uint64_t now)
+{
+    struct client *oldest = NULL;
+    struct client *client;
+    uint32_t slot = clients_hash(addr);
+
+    for (int i = 0; i < CLIENTS_MAX; i++)
+    {
+        client = &clients[(slot + i) % CLIENTS_MAX];
+
+        if (!client->used)
+        {
+            memset(client, 0, sizeof(*client));
+            client->used = 1;
+            client->addr = *addr;
+            client->last_seen_ns = now;
+            return client;
+        }
+        if (client->addr.sin_addr.s_addr == addr->sin_addr.s_addr && client->addr.sin_port == addr->sin_port)
+        {
+            client->last_seen_ns = now;
+            return client;
+        }
+        if (oldest == NULL || client->last_seen_ns < oldest->last_seen_ns)
+            oldest = client;
+    }
+
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->used = 1;
+    oldest->addr = *addr;
+    oldest->last_seen_ns = now;
+    return oldest;
+}
+
+/**
+ * @brief Tells whether a session is one the client ran before the current one. Must be
+ *        called with clients_lock held.
+ */
+static int clients_retired(const struct client *client, uint32_t session)
+{
+    for (int i = 0; i < client->retired_count; i++)
+    {
+        if (client->retired[i] == session)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Tells whether a client already sent a sequence number. Numbers older than
+ *        the window count as seen: they can only be stale retransmissions. So do frames
+ *        of a session the client ran before, which arrive late: taking them would start
+ *        that session over and forget the window of the current one.
+ * @param addr The client address.
+ * @param session The session of the datagram.
+ * @param seq The sequence number of the datagram.
+ * @return 1 if it was seen before, 0 if it is new.
+ */
+int clients_seen(const struct sockaddr_in *addr, uint32_t session, uint32_t seq)
+{
+    struct client *client;
+    uint32_t age;
+    int seen;
+
+    pthread_mutex_lock(&clients_lock);
+    client = clients_find(addr, stats_now());
+
+    if (client->window != 0 && clients_retired(client, session))
+        seen = 1;
+    else if (client->session != session || client->window == 0)
+        seen = 0;
+    else if ((int32_t)(seq - client->highest) > 0)
+        seen = 0;
+    else
+    {
+        age = client->highest - seq;
+        seen = age >= CLIENTS_WINDOW || (client->window >> age) & 1;
+    }
+
+    pthread_mutex_unlock(&clients_lock);
+    return seen;
+}
+
+/**
+ * @brief Remembers that a client's sequence number was accepted. A new session
+ *        starts a new window, and the one it replaces is retired.
+ * @param addr The client address.
+ * @param session The session of the datagram.
+ * @param seq The sequence number of the datagram.
+ */
+void clients_mark(const struct sockaddr_in *addr, uint32_t session, uint32_t seq)
+{
+    struct client *client;
+    uint32_t shift;
+
+    pthread_mutex_lock(&clients_lock);
+    client = clients_find(addr, stats_now());
+
+    if (client->session != session || client->window == 0)
+    {
+        if (client->window != 0)
+        {
+            memmove(&client->retired[1], &client->retired[0], (CLIENTS_RETIRED - 1) * sizeof(uint32_t));
+            client->retired[0] = client->session;
+            if (client->retired_count < CLIENTS_RETIRED)
+                client->retired_count++;
+        }
+        client->session = session;
+        client->highest = seq;
+        client->window = 1;
+    }
+    else if ((int32_t)(seq - client->highest) > 0)
+    {
+        shift = seq - client->highest;
+        client->window = shift >= CLIENTS_WINDOW ? 1 : (client->window << shift) | 1;
+        client->highest = seq;
+    }
+    else if (client->highest - seq < CLIENTS_WINDOW)
+    {
+        client->window |= 1ULL << (client->highest - seq);
+    }
+
+    pthread_mutex_unlock(&clients_lock);
+}
@@ -0,0 +1,127 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/* *********************************
+    Command parser
+************************************ */
+
+#define COMMAND_MAX_KEYS 1024                     // Most keys a single command can carry
+#define COMMAND_KEYS_SIZE (2 * COMMAND_MAX_KEYS + 1) // Room for "k k k ..." plus the terminator
+
+enum command_type
+{
+    CMD_INVALID, // Nothing the robot can do
+    CMD_KEYS,    // Press a sequence of keys
+    CMD_SIZE     // Change the keyboard size
+};
+
+/**
+ * A decoded client command, ready for the device.
+ */
+struct command
+{
+    enum command_type type;        // What the robot has to do
+    char keys[COMMAND_KEYS_SIZE];  // Space separated keys, or the size letter
+    int len;                       // Length of keys in bytes
+};
+
+/**
+ * @brief Decrypts and classifies an encrypted datagram in a single pass, without
+ *        allocating or building intermediate strings. A message whose only letter is
+ *        s, m or b is a size change; otherwise its digits are the keys to press and
+ *        every other byte is ignored.
+ * @param data The ROT128 encrypted datagram. It is not modified.
+ * @param len The datagram length in bytes.
+ * @param cmd Filled with the decoded command.
+ * @return 0 on success, -1 if the datagram holds neither a size nor any key.
+ */
+int command_parse(const char *data, size_t len, struct command *cmd)
+{
+    const unsigned char *in = (const unsigned char *)data;
+    char *out = cmd->keys;
+    char *end = cmd->keys + COMMAND_KEYS_SIZE - 1;
+    unsigned char letter = 0;
+    int letters = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = in[i] ^ 0x80; // ROT128
+
+        if ((unsigned char)(c - '0') < 10)
+        {
+            if (out + 2 <= end)
+            {
+                out[0] = c;
+                out[1] = ' ';
+                out += 2;
+            }
+        }
+        else if ((unsigned char)((c | 0x20) - 'a') < 26)
+        {
+            letter = c;
+            letters++;
+        }
+    }
+
+    if (letters == 1 && (letter == 's' || letter == 'm' || letter == 'b'))
+    {
+        cmd->type = CMD_SIZE;
+        cmd->keys[0] = letter;
+        cmd->keys[1] = '\0';
+        cmd->len = 1;
+        return 0;
+    }
+
+    *out = '\0';
+    cmd->len = out - cmd->keys;
+    cmd->type = cmd->len > 0 ? CMD_KEYS : CMD_INVALID;
+    return cmd->type == CMD_INVALID ? -1 : 0;
+}
+
+/**
+ * @brief Decodes one operation of a binary frame. Every byte maps straight to a key or
+ *        a size, so nothing has to be guessed from the characters.
+ * @param opcode PROTO_PRESS or PROTO_SET_SIZE.
+ * @param data The operation payload, already decrypted.
+ * @param len The payload length in bytes.
+ * @param cmd Filled with the decoded command.
+ * @return 0 on success, -1 if the payload is not a valid operation.
+ */
+int command_from_op(uint8_t opcode, const char *data, size_t len, struct command *cmd)
+{
+    static const char sizes[] = {'s', 'm', 'b'}; // Indexed by enum proto_size
+    const unsigned char *in = (const unsigned char *)data;
+    unsigned char c;
+
+    cmd->type = CMD_INVALID;
+
+    if (opcode == PROTO_SET_SIZE)
+    {
+        if (len != 1 || (c = in[0]) >= sizeof(sizes))
+            return -1;
+
+        cmd->type = CMD_SIZE;
+        cmd->keys[0] = sizes[c];
+        cmd->keys[1] = '\0';
+        cmd->len = 1;
+        return 0;
+    }
+
+    if (opcode != PROTO_PRESS || len == 0 || len > COMMAND_MAX_KEYS)
+        return -1;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        c = in[i];
+        if (c > 9)
+            return -1;
+
+        cmd->keys[2 * i] = '0' + c;
+        cmd->keys[2 * i + 1] = ' ';
+    }
+
+    cmd->keys[2 * len] = '\0';
+    cmd->len = 2 * len;
+    cmd->type = CMD_KEYS;
+    return 0;
+}
@@ -0,0 +1,760 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <my_lib.h>
+
+/* *********************************
+    Device queue
+************************************ */
+
+#define DEVICE_QUEUE_DEPTH 256            // Most commands waiting for each client
+#define DEVICE_MARGIN_MS 200              // Default time the robot is held beyond the predicted duration
+#define DEVICE_COALESCE_KEYS 16           // Default most keys merged into one serial frame
+#define DEVICE_COALESCE_MS 20             // Default time to wait for more keys to merge
+#define DEVICE_COALESCE_CMDS 64           // Most commands merged into one serial frame
+#define DEVICE_ADMIT_DEPTH 32             // Default commands a client may have queued before new ones are refused
+#define DEVICE_FLOWS 64                   // Clients each robot keeps a queue for at once
+#define DEVICE_QUANTUM_KEYS 4             // Robot time a client of weight 1 gets per round, in key presses
+#define DEVICE_WEIGHTS_MAX 32             // Clients that can be given a weight
+#define DEVICE_TTL_MS 60000               // Default time a command stays useful after it arrives
+
+/**
+ * A decoded command waiting for the device.
+ */
+struct device_cmd
+{
+    struct command command;       // What the robot has to do
+    struct sockaddr_in addr;      // Client that sent the command
+    uint64_t received_ns;         // When its datagram was received, from stats_now()
+    uint64_t deadline_ns;         // When the command stops being useful, from stats_now(); 0 for never
+    int framed;                   // Whether it came in a frame, so the client can be told it expired
+    uint32_t session;             // Session of the frame
+    uint32_t seq;                 // Sequence number of the frame
+};
+
+/**
+ * FIFO of the commands one client has waiting for a robot.
+ */
+struct device_flow
+{
+    int used;                     // Whether the flow belongs to a client
+    struct sockaddr_in addr;      // The client
+    struct device_cmd *cmds;      // Ring of commands, device_admit_depth slots
+    int head;                     // Index of the oldest command
+    int count;                    // Number of queued commands
+    int weight;                   // Share of the robot relative to other clients
+    long deficit;                 // Robot time the client may still use this round, in milliseconds
+    long pending_ms;              // Predicted work queued
+    int active;                   // Whether the flow is in the round-robin list
+    int next;                     // Next flow in the round-robin list, or -1
+    struct stats_client *stats;   // Counters of the client
+};
+
+/**
+ * Commands waiting for one robot, one FIFO per client, served by deficit round robin
+ * by the robot's consumer thread.
+ */
+struct device_queue
+{
+    int index;                         // Position of the robot in the pool
+    struct device_flow flows[DEVICE_FLOWS]; // Per-client queues
+    int active_head;                   // First flow of the round-robin list, or -1
+    int active_tail;                   // Last flow of the round-robin list, or -1
+    long active_weight;                // Sum of the weights of the flows in the list
+    int count;                         // Number of queued commands
+    long pending_ms;                   // Predicted work queued or in progress
+    struct model_position position;    // Where the robot is, as far as the model knows
+    pthread_mutex_t lock;              // Protects the flows
+    pthread_cond_t not_empty;          // Signaled when a command is queued
+    pthread_t thread;                  // Consumer thread
+};
+
+enum device_route
+{
+    ROUTE_AFFINITY, // A client always uses the same robot, so its commands stay in order
+    ROUTE_LEAST     // Each command goes to the robot with the least pending work
+};
+
+/**
+ * Weight given to a client with -W.
+ */
+struct device_weight
+{
+    uint32_t addr; // IPv4 address, network byte order
+    uint16_t port; // Port, network byte order, or 0 for any
+    int weight;    // Share of the robot
+};
+
+static struct device_queue *devices;
+static int device_count;
+static kp_pool *device_pool;
+static enum device_route device_route = ROUTE_AFFINITY;
+static unsigned long device_turn;          // Ticket allowed to insert next
+static pthread_mutex_t device_turn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t device_turn_cond = PTHREAD_COND_INITIALIZER;
+static struct model device_model;          // Predicts how long the robot takes
+static int device_margin_ms = DEVICE_MARGIN_MS;
+static long device_quantum_ms;             // Robot time a client of weight 1 gets per round
+static int device_coalesce_keys = DEVICE_COALESCE_KEYS;
+static int device_coalesce_ms = DEVICE_COALESCE_MS;
+static int device_admit_depth = DEVICE_ADMIT_DEPTH;
+static struct device_weight device_weights[DEVICE_WEIGHTS_MAX];
+static int device_weight_count;
+static void (*device_on_expired)(const struct device_cmd *cmd); // Tells a client its command expired
+
+static int device_hold_ms(const struct device_cmd *cmd);
+
+/**
+ * @brief Picks the robot that will run a job's commands. It is picked once per job,
+ *        and the same robot is given to device_admit() and device_push().
+ */
+struct device_queue *device_pick(const struct device_cmd *cmd)
+{
+    struct device_queue *best = &devices[0];
+    uint32_t hash;
+
+    if (device_route == ROUTE_AFFINITY)
+    {
+        hash = cmd->addr.sin_addr.s_addr * 2654435761u ^ cmd->addr.sin_port;
+        return &devices[hash % device_count];
+    }
+
+    for (int i = 1; i < device_count; i++)
+    {
+        if (__atomic_load_n(&devices[i].pending_ms, __ATOMIC_RELAXED) <
+            __atomic_load_n(&best->pending_ms, __ATOMIC_RELAXED))
+            best = &devices[i];
+    }
+    return best;
+}
+
+/**
+ * @brief Reads the client weights, given as addr[:port]=weight entries separated by
+ *        commas. Clients not listed have weight 1.
+ * @param spec The weights, such as 10.0.0.5=4,127.0.0.1:9000=2.
+ * @return 0 on success, -1 if the list is malformed.
+ */
+int device_set_weights(const char *spec)
+{
+    char entry[64];
+    char *port;
+    char *weight;
+    struct in_addr addr;
+    size_t len;
+
+    device_weight_count = 0;
+    while (*spec != '\0')
+    {
+        len = strcspn(spec, ",");
+        if (len == 0 || len >= sizeof(entry) || device_weight_count == DEVICE_WEIGHTS_MAX)
+            return -1;
+        memcpy(entry, spec, len);
+        entry[len] = '\0';
+        spec += spec[len] == ',' ? len + 1 : len;
+
+        weight = strchr(entry, '=');
+        if (weight == NULL)
+            return -1;
+        *weight++ = '\0';
+        port = strchr(entry, ':');
+        if (port != NULL)
+            *port++ = '\0';
+
+        if (inet_pton(AF_INET, entry, &addr) != 1 || atoi(weight) <= 0)
+            return -1;
+
+        device_weights[device_weight_count].addr = addr.s_addr;
+        device_weights[device_weight_count].port = port != NULL ? htons(atoi(port)) : 0;
+        device_weights[device_weight_count].weight = atoi(weight);
+        device_weight_count++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sets the function that tells a client one of its commands expired. It runs on
+ *        a consumer thread with the robot's lock held, so it must not block.
+ */
+void device_set_expired(void (*on_expired)(const struct device_cmd *cmd))
+{
+    device_on_expired = on_expired;
+}
+
+/**
+ * @brief Returns the weight of a client.
+ */
+static int device_weight(const struct sockaddr_in *addr)
+{
+    for (int i = 0; i < device_weight_count; i++)
+    {
+        if (device_weights[i].addr == addr->sin_addr.s_addr &&
+            (device_weights[i].port == 0 || device_weights[i].port == addr->sin_port))
+            return device_weights[i].weight;
+    }
+    return 1;
+}
+
+/**
+ * @brief Finds the queue of a client on a robot, giving it one if it has none. A flow
+ *        with nothing queued can be handed to a new client. Must be called with the
+ *        robot's lock held.
+ * @return The flow, or NULL if every flow has commands queued.
+ */
+static struct device_flow *device_flow(struct device_queue *device, const struct sockaddr_in *addr)
+{
+    struct device_flow *idle = NULL;
+    struct device_flow *flow;
+    uint32_t slot = (addr->sin_addr.s_addr * 2654435761u ^ addr->sin_port) % DEVICE_FLOWS;
+
+    for (int i = 0; i < DEVICE_FLOWS; i++)
+    {
+        flow = &device->flows[(slot + i) % DEVICE_FLOWS];
+
+        if (flow->used && flow->addr.sin_addr.s_addr == addr->sin_addr.s_addr && flow->addr.sin_port == addr->sin_port)
+            return flow;
+        if (idle == NULL && (!flow->used || (flow->count == 0 && !flow->active)))
+            idle = flow;
+    }
+
+    if (idle == NULL)
+        return NULL;
+
+    if (idle->cmds == NULL)
+    {
+        idle->cmds = (struct device_cmd *)calloc(device_admit_depth, sizeof(struct device_cmd));
+        if (idle->cmds == NULL)
+            return NULL;
+    }
+
+    idle->used = 1;
+    idle->addr = *addr;
+    idle->head = 0;
+    idle->count = 0;
+    idle->deficit = 0;
+    idle->pending_ms = 0;
+    idle->weight = device_weight(addr);
+    idle->stats = stats_client(addr->sin_addr.s_addr, addr->sin_port);
+    idle->stats->weight = idle->weight;
+    idle->stats->robot = device->index;
+    return idle;
+}
+
+/**
+ * @brief Appends a flow to the round-robin list. Must be called with the robot's lock held.
+ */
+static void device_activate(struct device_queue *device, struct device_flow *flow)
+{
+    int index = flow - device->flows;
+
+    flow->active = 1;
+    flow->next = -1;
+    if (device->active_tail < 0)
+        device->active_head = index;
+    else
+        device->flows[device->active_tail].next = index;
+    device->active_tail = index;
+    device->active_weight += flow->weight;
+}
+
+/**
+ * @brief Removes the first flow of the round-robin list. Must be called with the robot's
+ *        lock held.
+ */
+static struct device_flow *device_deactivate(struct device_queue *device)
+{
+    struct device_flow *flow = &device->flows[device->active_head];
+
+    device->active_head = flow->next;
+    if (device->active_head < 0)
+        device->active_tail = -1;
+    device->active_weight -= flow->weight;
+    flow->active = 0;
+    return flow;
+}
+
+/**
+ * @brief Waits for a job's turn to hand its command to the robots. Turns are taken in
+ *        the order the datagrams were received, so only one worker at a time is
+ *        between device_turn_begin() and device_turn_end().
+ * @param ticket The ticket of the job.
+ */
+void device_turn_begin(unsigned long ticket)
+{
+    pthread_mutex_lock(&device_turn_lock);
+
+    while (device_turn != ticket)
+        pthread_cond_wait(&device_turn_cond, &device_turn_lock);
+}
+
+/**
+ * @brief Passes the turn to the next job.
+ */
+void device_turn_end()
+{
+    device_turn++;
+    pthread_cond_broadcast(&device_turn_cond);
+    pthread_mutex_unlock(&device_turn_lock);
+}
+
+/**
+ * @brief Returns when a command stops being useful, for ordering: never sorts last.
+ */
+static inline uint64_t device_deadline(const struct device_cmd *cmd)
+{
+    return cmd->deadline_ns != 0 ? cmd->deadline_ns : UINT64_MAX;
+}
+
+/**
+ * @brief Queues a command for a robot among the commands of the same client, in order
+ *        of deadline and then of arrival, so a client's commands keep their order unless
+ *        it gives one a shorter deadline. Must be called during the job's turn, after
+ *        device_admit() made room for it; it never waits, since every worker is behind
+ *        the turn.
+ * @param device The robot, from device_pick().
+ * @param cmd The command to queue.
+ * @return 0 on success, -1 if the client's queue has no room.
+ */
+int device_push(struct device_queue *device, const struct device_cmd *cmd)
+{
+    struct device_flow *flow;
+    int slot;
+
+    pthread_mutex_lock(&device->lock);
+    flow = device_flow(device, &cmd->addr);
+    if (flow == NULL || flow->count == device_admit_depth)
+    {
+        pthread_mutex_unlock(&device->lock);
+        return -1;
+    }
+
+    // Insertion sort from the back: most commands go last and move nothing
+    slot = flow->count;
+    while (slot > 0 && device_deadline(&flow->cmds[(flow->head + slot - 1) % device_admit_depth]) > device_deadline(cmd))
+    {
+        flow->cmds[(flow->head + slot) % device_admit_depth] = flow->cmds[(flow->head + slot - 1) % device_admit_depth];
+        slot--;
+    }
+    flow->cmds[(flow->head + slot) % device_admit_depth] = *cmd;
+    flow->count++;
+    flow->pending_ms += device_hold_ms(cmd);
+    if (!flow->active)
+        device_activate(device, flow);
+
+    device->count++;
+    __atomic_fetch_add(&device->pending_ms, device_hold_ms(cmd), __ATOMIC_RELAXED);
+    stats_add(device_queued, 1);
+    stats_client_add(flow->stats, queued, 1);
+    pthread_cond_signal(&device->not_empty);
+    pthread_mutex_unlock(&device->lock);
+    return 0;
+}
+
+/**
+ * @brief Tells whether a client can queue more commands on its robot without going
+ *        over the admission depth. Must be called during the job's turn; only the
+ *        consumer takes commands meanwhile, so the room stays there for device_push().
+ * @param device The robot, from device_pick().
+ * @param cmd The first of the commands.
+ * @param count How many commands would be queued.
+ * @return 0 if they are admitted, -1 if there are more than the admission depth and
+ *         they never will be, otherwise about how long the client's queue needs to
+ *         drain enough for them, in milliseconds.
+ */
+long device_admit(struct device_queue *device, const struct device_cmd *cmd, int count)
+{
+    struct device_flow *flow;
+    long retry = 0;
+    long excess;
+    long share;
+
+    if (count > device_admit_depth)
+        return -1;
+
+    pthread_mutex_lock(&device->lock);
+    flow = device_flow(device, &cmd->addr);
+
+    if (flow == NULL)
+    {
+        // Every queue is taken: wait for about one command of each client
+        retry = __atomic_load_n(&device->pending_ms, __ATOMIC_RELAXED) / (device->count + 1) * DEVICE_FLOWS;
+        retry = retry > 0 ? retry : 1;
+    }
+    else
+    {
+        excess = flow->count + count - device_admit_depth;
+
+        // The excess commands have to go first, and the client only gets its share of the robot
+        if (excess > 0)
+        {
+            share = device->active_weight > flow->weight ? device->active_weight : flow->weight;
+            retry = flow->pending_ms * excess / flow->count * share / flow->weight;
+            retry = retry > 0 ? retry : 1;
+        }
+    }
+
+    pthread_mutex_unlock(&device->lock);
+    return retry;
+}
+
+/**
+ * @brief Queues a command for a robot in arrival order, if its client has room.
+ * @param ticket The ticket of the job the command was decoded from.
+ * @param cmd The command to queue, or NULL to give up the turn without queuing anything.
+ * @return 0 on success, -1 if the command wasn't queued.
+ */
+int device_enqueue(unsigned long ticket, const struct device_cmd *cmd)
+{
+    int result = -1;
+
+    device_turn_begin(ticket);
+    if (cmd != NULL)
+        result = device_push(device_pick(cmd), cmd);
+    device_turn_end();
+    return result;
+}
+
+/**
+ * @brief Returns about how long the robot needs to carry out a command, in milliseconds,
+ *        for accounting the work that is queued. It doesn't depend on the order the
+ *        commands run in, so the same value can be added and taken away later.
+ */
+static int device_hold_ms(const struct device_cmd *cmd)
+{
+    return model_estimate(&device_model, &cmd->command);
+}
+
+/**
+ * @brief Sleeps for the given number of milliseconds.
+ */
+static void sleep_ms(int ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) == -1)
+        ;
+}
+
+/**
+ * @brief Picks the client the robot serves next, by deficit round robin: the first
+ *        client of the list is served while its deficit covers its next command, and
+ *        otherwise gets its quantum and goes to the back of the list. Over time each
+ *        client gets robot time in proportion to its weight, however much it sends.
+ *        Must be called with the lock held and a command queued.
+ */
+static struct device_flow *device_next(struct device_queue *device)
+{
+    struct device_flow *flow;
+
+    while (1)
+    {
+        flow = &device->flows[device->active_head];
+        if (device_hold_ms(&flow->cmds[flow->head]) <= flow->deficit)
+            return flow;
+
+        flow->deficit += flow->weight * device_quantum_ms;
+        if (flow->next >= 0)
+        {
+            device_deactivate(device);
+            device_activate(device, flow);
+        }
+    }
+}
+
+/**
+ * @brief Takes the oldest command of a client's queue. Must be called with the lock
+ *        held and the queue not empty.
+ * @param device The robot's queue.
+ * @param flow The client's queue.
+ * @param cmd Receives the command.
+ */
+static void device_take(struct device_queue *device, struct device_flow *flow, struct device_cmd *cmd)
+{
+    *cmd = flow->cmds[flow->head];
+    flow->head = (flow->head + 1) % device_admit_depth;
+    flow->count--;
+    flow->pending_ms -= device_hold_ms(cmd);
+    device->count--;
+    stats_add(device_queued, -1);
+    stats_client_add(flow->stats, queued, -1);
+    stats_client_add(flow->stats, wait_us, (stats_now() - cmd->received_ns) / 1000);
+    stats_record(STAT_WAIT, cmd->received_ns, stats_now());
+}
+
+/**
+ * @brief Drops the commands at the front of a client's queue whose deadline has passed
+ *        and tells their clients. The queue is in deadline order, so they are all at
+ *        the front. Must be called with the lock held.
+ * @param device The robot's queue.
+ * @param flow The client's queue, the first of the round-robin list.
+ * @return The number of commands dropped.
+ */
+static int device_expire(struct device_queue *device, struct device_flow *flow)
+{
+    struct device_cmd cmd;
+    uint64_t now = stats_now();
+    int dropped = 0;
+
+    while (flow->count > 0 && device_deadline(&flow->cmds[flow->head]) < now)
+    {
+        device_take(device, flow, &cmd);
+        __atomic_fetch_sub(&device->pending_ms, device_hold_ms(&cmd), __ATOMIC_RELAXED);
+        stats_add(expired, 1);
+        log_warn_s("expired - %s, waited %ld ms", cmd.command.keys, (long)((now - cmd.received_ns) / 1000000));
+        if (device_on_expired != NULL)
+            device_on_expired(&cmd);
+        dropped++;
+    }
+
+    if (dropped > 0 && flow->count == 0)
+    {
+        flow->deficit = 0;
+        device_deactivate(device);
+    }
+    return dropped;
+}
+
+/**
+ * @brief Merges the key presses a client has queued right behind a command into it, so
+ *        the robot presses them in one frame: one delete, all the keys, one enter. Waits
+ *        up to device_coalesce_ms for more to arrive. Must be called with the lock held.
+ * @param device The robot's queue.
+ * @param flow The client's queue.
+ * @param cmd A command just taken from the flow, extended in place.
+ * @param received Receives the arrival time of every merged command, cmd's first.
+ * @param pending Receives the predicted work of the merged commands, in milliseconds.
+ * @return The number of commands in cmd.
+ */
+static int device_coalesce(struct device_queue *device, struct device_flow *flow, struct device_cmd *cmd,
+                           uint64_t *received, long *pending)
+{
+    struct device_cmd next;
+    struct timespec deadline;
+    int keys = cmd->command.len / 2;
+    int count = 1;
+
+    received[0] = cmd->received_ns;
+    *pending = device_hold_ms(cmd);
+
+    if (cmd->command.type != CMD_KEYS)
+        return count;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (deadline.tv_nsec + device_coalesce_ms * 1000000L) / 1000000000L;
+    deadline.tv_nsec = (deadline.tv_nsec + device_coalesce_ms * 1000000L) % 1000000000L;
+
+    while (count < DEVICE_COALESCE_CMDS)
+    {
+        if (flow->count == 0)
+        {
+            if (device_coalesce_ms <= 0 ||
+                pthread_cond_timedwait(&device->not_empty, &device->lock, &deadline) == ETIMEDOUT)
+                break;
+            continue;
+        }
+
+        if (flow->cmds[flow->head].command.type != CMD_KEYS || device_deadline(&flow->cmds[flow->head]) < stats_now() ||
+            keys + flow->cmds[flow->head].command.len / 2 > device_coalesce_keys)
+            break;
+
+        device_take(device, flow, &next);
+        memcpy(cmd->command.keys + cmd->command.len, next.command.keys, next.command.len + 1);
+        cmd->command.len += next.command.len;
+        keys += next.command.len / 2;
+        received[count++] = next.received_ns;
+        *pending += device_hold_ms(&next);
+    }
+
+    return count;
+}
+
+/**
+ * @brief Consumer thread body: sends the commands queued for one robot one at a time,
+ *        sharing the robot between clients by weight, and holds the robot until it
+ *        reports each one done. Key presses a client queued back to back go out as a
+ *        single command.
+ * @param arg The device_queue of the robot.
+ */
+static void *device_consumer(void *arg)
+{
+    struct device_queue *device = (struct device_queue *)arg;
+    struct device_flow *flow;
+    struct device_cmd cmd;
+    uint64_t received[DEVICE_COALESCE_CMDS];
+    struct stats_client *client;
+    kp_handle *handle;
+    uint64_t write_start;
+    uint64_t write_end;
+    uint64_t released;
+    long pending;
+    int failed = 0;
+    int count;
+    int result;
+    int hold;
+
+    while (1)
+    {
+        pthread_mutex_lock(&device->lock);
+        do
+        {
+            while (device->count == 0)
+                pthread_cond_wait(&device->not_empty, &device->lock);
+            flow = device_next(device);
+        } while (device_expire(device, flow) > 0);
+
+        device_take(device, flow, &cmd);
+        count = device_coalesce(device, flow, &cmd, received, &pending);
+        client = flow->stats;
+
+        // The flow leaves the list once empty, and starts its next round with no credit
+        flow->deficit -= device_hold_ms(&cmd);
+        if (flow->count == 0)
+        {
+            flow->deficit = 0;
+            if (flow->active && &device->flows[device->active_head] == flow)
+                device_deactivate(device);
+        }
+        pthread_mutex_unlock(&device->lock);
+
+        log_info_s("device acquired - %s (robot %ld, %ld commands)", cmd.command.keys, (long)device->index, (long)count);
+
+        // The port stays open between commands; it is only reopened after a failure
+        handle = kp_pool_get(device_pool, device->index);
+        if (handle == NULL || failed)
+        {
+            // Opening the port resets the robot
+            handle = kp_pool_reopen(device_pool, device->index);
+            device->position.row = MODEL_START_ROW;
+            device->position.col = MODEL_START_COL;
+        }
+
+        write_start = stats_now();
+
+        if (cmd.command.type == CMD_SIZE)
+            result = kp_set_size(handle, cmd.command.keys);
+        else
+            result = kp_press_keys(handle, cmd.command.keys);
+
+        write_end = stats_now();
+
+        failed = result < 0;
+        if (failed)
+        {
+            stats_add(write_errors, count);
+            log_error_s("device write - failed (%s)", kp_pool_path(device_pool, device->index));
+        }
+        else
+        {
+            stats_add(executed, count);
+            stats_record(STAT_WRITE, write_start, write_end);
+            for (int i = 0; i < count; i++)
+                stats_record(STAT_TOTAL, received[i], write_end);
+            log_debug("device write - succesfull (robot %ld)", (long)device->index);
+        }
+
+        // The robot is released as soon as the sketch reports the command done. The model's
+        // prediction only bounds the wait, and stands in when the port can't be read.
+        hold = failed ? 0 : model_predict(&device_model, &device->position, &cmd.command) + device_margin_ms;
+        if (hold > 0)
+        {
+            log_debug("device awaiting processing... (%ld ms)", (long)hold);
+            if (kp_wait_idle(handle, hold) == 0)
+                log_debug("device done (%ld ms)", (long)((stats_now() - write_end) / 1000000));
+            else if (errno == ETIMEDOUT)
+                log_warn("device still busy after %ld ms (robot %ld)", (long)hold, (long)device->index);
+            else if (errno == ECONNRESET)
+            {
+                log_warn("device restarted (robot %ld)", (long)device->index);
+                device->position.row = MODEL_START_ROW;
+                device->position.col = MODEL_START_COL;
+            }
+            else if ((hold -= (int)((stats_now() - write_end) / 1000000)) > 0)
+                sleep_ms(hold);
+        }
+
+        released = stats_now();
+        if (!failed)
+        {
+            stats_record(STAT_DEVICE, write_end, released);
+            stats_client_add(client, served, count);
+        }
+        stats_client_add(client, service_us, (released - write_start) / 1000);
+
+        __atomic_fetch_sub(&device->pending_ms, pending, __ATOMIC_RELAXED);
+        log_info("device released (robot %ld)", (long)device->index);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Opens the robots and starts the queues and a consumer thread for each one.
+ * @param spec The serial devices of the robots: a comma separated list, where
+ *             entries may use wildcards such as /dev/ttyUSB*.
+ * @param route How commands are spread across robots.
+ * @param model Predicts how long a robot needs for each command.
+ * @param margin_ms Time a robot is held beyond the predicted duration, in milliseconds.
+ * @param coalesce_keys Most keys merged into one frame; 1 sends every command alone.
+ * @param coalesce_ms Time to wait for more keys to merge, in milliseconds.
+ * @param admit_depth Commands a client may have queued before new ones are refused.
+ * @return 0 on success, -1 on failure.
+ */
+int device_start(const char *spec, enum device_route route, const struct model *model, int margin_ms, int coalesce_keys,
+                 int coalesce_ms, int admit_depth)
+{
+    pthread_condattr_t monotonic;
+    struct command key = {CMD_KEYS, "5 ", 2};
+
+    device_pool = kp_pool_open(spec);
+    if (device_pool == NULL)
+        return -1;
+
+    device_count = kp_pool_size(device_pool);
+    devices = (struct device_queue *)calloc(device_count, sizeof(struct device_queue));
+    if (devices == NULL)
+        return -1;
+
+    device_route = route;
+    device_model = *model;
+    device_margin_ms = margin_ms;
+
+    // A quantum is a few one-key sequences, and never less than a millisecond
+    device_quantum_ms = DEVICE_QUANTUM_KEYS * model_estimate(&device_model, &key) / 3;
+    if (device_quantum_ms < 1)
+        device_quantum_ms = 1;
+    device_coalesce_keys = coalesce_keys;
+    device_coalesce_ms = coalesce_ms;
+    device_admit_depth = admit_depth;
+    device_turn = 0;
+
+    // The coalescing window is measured on CLOCK_MONOTONIC
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+
+    for (int i = 0; i < device_count; i++)
+    {
+        devices[i].index = i;
+        devices[i].active_head = -1;
+        devices[i].active_tail = -1;
+        devices[i].position.row = MODEL_START_ROW;
+        devices[i].position.col = MODEL_START_COL;
+        pthread_mutex_init(&devices[i].lock, NULL);
+        pthread_cond_init(&devices[i].not_empty, &monotonic);
+
+        if (pthread_create(&devices[i].thread, NULL, device_consumer, &devices[i]) != 0)
+            return -1;
+        pthread_detach(devices[i].thread);
+
+        log_info_s("%s is robot %ld", kp_pool_path(device_pool, i), (long)i);
+    }
+
+    return 0;
+}
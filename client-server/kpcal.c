@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "colors.h"
+#include "proto.c"
+#include "command.c"
+#include "model.c"
+
+/* *********************************
+    Variables and Constants
+************************************ */
+
+#define KPCAL_SAMPLES 4096 // Most measurements read
+
+static struct model_features features[KPCAL_SAMPLES];
+static double measured[KPCAL_SAMPLES];
+static char names[KPCAL_SAMPLES][32];
+
+/* *********************************
+    Functions
+************************************ */
+
+/**
+ * @brief Builds the command the robot ran for a measurement: s, m or b for a size
+ *        change, otherwise the digits to press.
+ * @return 0 on success, -1 if there is nothing to run.
+ */
+static int read_command(const char *text, struct command *cmd)
+{
+    char *out = cmd->keys;
+
+    if (strlen(text) == 1 && strchr("smb", text[0]) != NULL)
+    {
+        cmd->type = CMD_SIZE;
+        cmd->keys[0] = text[0];
+        cmd->keys[1] = '\0';
+        cmd->len = 1;
+        return 0;
+    }
+
+    for (; *text != '\0' && out + 2 < cmd->keys + COMMAND_KEYS_SIZE; text++)
+    {
+        if (isdigit((unsigned char)*text))
+        {
+            *out++ = *text;
+            *out++ = ' ';
+        }
+    }
+    *out = '\0';
+    cmd->len = out - cmd->keys;
+    cmd->type = cmd->len > 0 ? CMD_KEYS : CMD_INVALID;
+    return cmd->type == CMD_INVALID ? -1 : 0;
+}
+
+/**
+ * @brief Entry point of kpcal, which fits the server's duration model to measured
+ *        timings. Each input line is a command as the robot received it, s, m, b or
+ *        the keys, and how long the robot took, in milliseconds, such as "1234 9120".
+ *        The commands are taken to run one after the other from power-on, so the
+ *        robot's position carries over from line to line.
+ * @param argc The number of command-line arguments.
+ * @param argv An array of strings containing the command-line arguments.
+ *             It may have: [-M step=ms,degree=ms,key=ms,size=ms] [measurements_file].
+ * @return 0 on success, 1 on incorrect arguments or measurements.
+ */
+int main(int argc, char *argv[])
+{
+    struct model model = model_default();
+    struct model_position position = {MODEL_START_ROW, MODEL_START_COL};
+    struct command cmd;
+    char line[256];
+    char text[32];
+    double ms, predicted, error = 0;
+    FILE *input = stdin;
+    int count = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "M:")) != -1)
+    {
+        if (opt != 'M' || model_parse(&model, optarg) < 0)
+            count = -1;
+    }
+
+    if (count < 0 || argc - optind > 1)
+    {
+        bold_yellow();
+        printf("⭐ Usage: %s [-M step=ms,degree=ms,key=ms,size=ms] [measurements_file]\n", argv[0]);
+        default_color();
+        return 1;
+    }
+
+    if (optind < argc && (input = fopen(argv[optind], "r")) == NULL)
+    {
+        bold_red();
+        printf("⛔ Couldn't open %s.\n", argv[optind]);
+        default_color();
+        return 1;
+    }
+
+    while (count < KPCAL_SAMPLES && fgets(line, sizeof(line), input) != NULL)
+    {
+        if (line[0] == '#' || sscanf(line, "%31s %lf", text, &ms) != 2)
+            continue;
+        if (read_command(text, &cmd) < 0)
+            continue;
+
+        memset(&features[count], 0, sizeof(features[count]));
+        model_features(&position, &cmd, &features[count]);
+        measured[count] = ms;
+        snprintf(names[count], sizeof(names[count]), "%s", text);
+        count++;
+    }
+
+    if (model_fit(&model, features, measured, count) < 0)
+    {
+        bold_red();
+        printf("⛔ The %d measurements can't tell the constants apart; measure keys on every row.\n", count);
+        default_color();
+        return 1;
+    }
+
+    bold_magenta();
+    printf("  %-12s %10s %10s\n", "command", "measured", "predicted");
+    default_color();
+    for (int i = 0; i < count; i++)
+    {
+        predicted = model_cost(&model, &features[i]);
+        error += (predicted - measured[i]) * (predicted - measured[i]);
+        printf("  %-12s %10.0f %10.0f\n", names[i], measured[i], predicted);
+    }
+
+    bold_cyan();
+    printf("\n  rms error %.1f ms over %d measurements\n", count ? sqrt(error / count) : 0.0, count);
+    default_color();
+    printf("  -M step=%.1f,degree=%.2f,key=%.1f,size=%.0f\n", model.step_ms, model.degree_ms, model.key_ms,
+           model.size_ms);
+    return 0;
+}
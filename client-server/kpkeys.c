@@ -0,0 +1,148 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <my_lib.h>
+
+#include "colors.h"
+
+/* *********************************
+    Variables and Constants
+************************************ */
+
+#define KPKEYS_TIMEOUT_MS 2000 // Longest wait for the robot to answer an entry
+
+/* *********************************
+    Functions
+************************************ */
+
+/**
+ * @brief Sends a calibration entry and waits for the robot to answer it.
+ * @return 0 on success, -1 if the entry is invalid, the robot rejected it or didn't answer.
+ */
+static int send_entry(kp_handle *handle, const char *entry)
+{
+    if (kp_calibrate(handle, entry) < 0)
+        return -1;
+
+    if (kp_wait_idle(handle, KPKEYS_TIMEOUT_MS) < 0)
+    {
+        if (errno == EINVAL)
+            return -1;
+        bold_red();
+        printf("⛔ The robot didn't answer %s; does its sketch support calibration?\n", entry);
+        default_color();
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Entry point of kpkeys, which writes the robot's calibration over the serial
+ *        port. A line gives the absolute servo angles of a key for a keyboard size: the
+ *        size (s, m or b), the key, then the LR, FB and touch height angles, such as
+ *        "s 1 102 122 80". A line starting with p gives the press profile of a row
+ *        instead: the size, the row (0 to 3), then max_step, accel, tick_ms,
+ *        slow_degrees and slow_ms, such as "p s 3 4 1 6 4 6". Anything not listed keeps
+ *        its value. The calibration is then saved to the robot's EEPROM.
+ * @param argc The number of command-line arguments.
+ * @param argv An array of strings containing the command-line arguments.
+ *             It may have: [-d device] [-r] [-n] [table_file]. -r starts from the
+ *             factory angles, -n doesn't save the table.
+ * @return 0 on success, 1 on incorrect arguments or if the robot rejects the table.
+ */
+int main(int argc, char *argv[])
+{
+    const char *device = KP_DEFAULT_DEVICE;
+    FILE *input = stdin;
+    kp_handle *handle;
+    char line[256];
+    char entry[32];
+    char size, key;
+    int lr, fb, touch;
+    int max_step, accel, tick_ms, slow_degrees, slow_ms;
+    int reset = 0;
+    int save = 1;
+    int count = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:rn")) != -1)
+    {
+        if (opt == 'd')
+            device = optarg;
+        else if (opt == 'r')
+            reset = 1;
+        else if (opt == 'n')
+            save = 0;
+        else
+            count = -1;
+    }
+
+    if (count < 0 || argc - optind > 1)
+    {
+        bold_yellow();
+        printf("⭐ Usage: %s [-d device] [-r] [-n] [table_file]\n", argv[0]);
+        default_color();
+        return 1;
+    }
+
+    if (optind < argc && (input = fopen(argv[optind], "r")) == NULL)
+    {
+        bold_red();
+        printf("⛔ Couldn't open %s.\n", argv[optind]);
+        default_color();
+        return 1;
+    }
+
+    handle = kp_open(device);
+    if (handle == NULL)
+    {
+        bold_red();
+        printf("⛔ Couldn't open %s.\n", device);
+        default_color();
+        return 1;
+    }
+
+    if (reset && send_entry(handle, "d") < 0)
+    {
+        kp_close(handle);
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), input) != NULL)
+    {
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, " p %c %c %d %d %d %d %d", &size, &key, &max_step, &accel, &tick_ms, &slow_degrees,
+                   &slow_ms) == 7)
+            snprintf(entry, sizeof(entry), "p%c%c=%d,%d,%d,%d,%d", size, key, max_step, accel, tick_ms,
+                     slow_degrees, slow_ms);
+        else if (sscanf(line, " %c %c %d %d %d", &size, &key, &lr, &fb, &touch) == 5)
+            snprintf(entry, sizeof(entry), "%c%c=%d,%d,%d", size, key, lr, fb, touch);
+        else
+            continue;
+
+        if (send_entry(handle, entry) < 0)
+        {
+            bold_red();
+            printf("⛔ Rejected: %s", line);
+            default_color();
+            kp_close(handle);
+            return 1;
+        }
+        count++;
+    }
+
+    if (save && send_entry(handle, "w") < 0)
+    {
+        kp_close(handle);
+        return 1;
+    }
+
+    bold_cyan();
+    printf("\n  %d entries calibrated%s\n", count, save ? ", saved to the EEPROM" : "");
+    default_color();
+    kp_close(handle);
+    return 0;
+}
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "colors.h"
+#include "stats.c"
+
+/* *********************************
+    Variables and Constants
+************************************ */
+
+#define KPSTAT_INTERVAL 1 // Default seconds between refreshes
+
+static const char *stage_names[STAT_STAGES] = {"parse", "wait", "write", "device", "total"}; // Printed name of each stats_stage
+static struct stats_segment previous; // Snapshot of the last refresh
+
+/* *********************************
+    Functions
+************************************ */
+
+/**
+ * @brief Maps the server's statistics segment read-only.
+ * @return The segment, or NULL if no server is publishing one.
+ */
+static const struct stats_segment *attach()
+{
+    int fd;
+    void *segment;
+
+    fd = shm_open(STATS_NAME, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+
+    segment = mmap(NULL, sizeof(struct stats_segment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED)
+        return NULL;
+
+    return (const struct stats_segment *)segment;
+}
+
+/**
+ * @brief Formats a latency in microseconds with a readable unit.
+ */
+static const char *format_us(char *buf, size_t size, uint64_t us)
+{
+    if (us < 1000)
+        snprintf(buf, size, "%lluus", (unsigned long long)us);
+    else if (us < 1000000)
+        snprintf(buf, size, "%.1fms", us / 1000.0);
+    else
+        snprintf(buf, size, "%.2fs", us / 1000000.0);
+    return buf;
+}
+
+/**
+ * @brief Prints one histogram line: sample count, p50, p99, p999 and max.
+ */
+static void print_histogram(const char *name, const struct stats_histogram *histogram)
+{
+    char p50[16], p99[16], p999[16], max[16];
+
+    bold_white();
+    printf("  %-8s", name);
+    default_color();
+
+    if (histogram->count == 0)
+    {
+        printf(" %10s %10s %10s %10s %10s\n", "0", "-", "-", "-", "-");
+        return;
+    }
+
+    printf(" %10llu %10s %10s %10s %10s\n", (unsigned long long)histogram->count,
+           format_us(p50, sizeof(p50), stats_percentile(histogram, 0.50)),
+           format_us(p99, sizeof(p99), stats_percentile(histogram, 0.99)),
+           format_us(p999, sizeof(p999), stats_percentile(histogram, 0.999)),
+           format_us(max, sizeof(max), histogram->max));
+}
+
+/**
+ * @brief Prints one line per client: its queue depth, how much it was served and its
+ *        average wait and service times.
+ */
+static void print_clients(const struct stats_segment *current)
+{
+    char name[32], wait[16], service[16];
+    struct in_addr addr;
+    const struct stats_client *client;
+
+    bold_magenta();
+    printf("\n  %-21s %5s %6s %8s %10s %10s %10s\n", "client", "robot", "weight", "queued", "served", "avg wait",
+           "avg service");
+    default_color();
+
+    for (int i = 0; i < STATS_CLIENTS; i++)
+    {
+        client = &current->clients[i];
+        if (client->key == 0)
+            continue;
+
+        if (client->key == ~0ULL)
+            snprintf(name, sizeof(name), "(others)");
+        else
+        {
+            addr.s_addr = (uint32_t)(client->key >> 16);
+            snprintf(name, sizeof(name), "%s:%u", inet_ntoa(addr), ntohs((uint16_t)client->key));
+        }
+
+        printf("  %-21s %5u %6u %8lld %10llu %10s %10s\n", name, client->robot, client->weight,
+               (long long)client->queued, (unsigned long long)client->served,
+               format_us(wait, sizeof(wait), client->served ? client->wait_us / client->served : 0),
+               format_us(service, sizeof(service), client->served ? client->service_us / client->served : 0));
+    }
+}
+
+/**
+ * @brief Prints the counters, the queue depths and the latency percentiles.
+ * @param current A copy of the segment.
+ * @param all_time Whether to show percentiles since start instead of since the last refresh.
+ */
+static void print_stats(const struct stats_segment *current, int all_time)
+{
+    struct stats_histogram delta;
+    uint64_t uptime = time(NULL) - current->started;
+
+    if (isatty(STDOUT_FILENO))
+        printf("\033[H\033[2J");
+
+    bold_cyan();
+    printf("kp server  up %02llu:%02llu:%02llu\n", (unsigned long long)(uptime / 3600),
+           (unsigned long long)(uptime / 60 % 60), (unsigned long long)(uptime % 60));
+    default_color();
+
+    printf("  received %llu  executed %llu  ignored %llu  rejected %llu  expired %llu  write errors %llu  kernel drops %llu  truncated %llu\n",
+           (unsigned long long)current->received, (unsigned long long)current->executed,
+           (unsigned long long)current->ignored, (unsigned long long)current->rejected,
+           (unsigned long long)current->expired, (unsigned long long)current->write_errors,
+           (unsigned long long)current->kernel_drops, (unsigned long long)current->truncated);
+    printf("  queued   jobs %llu  device %llu\n\n",
+           (unsigned long long)current->jobs_queued, (unsigned long long)current->device_queued);
+
+    bold_magenta();
+    printf("  %-8s %10s %10s %10s %10s %10s  (%s)\n", "stage", "count", "p50", "p99", "p999", "max",
+           all_time ? "since start" : "last interval");
+    default_color();
+
+    for (int i = 0; i < STAT_STAGES; i++)
+    {
+        if (all_time)
+        {
+            print_histogram(stage_names[i], &current->histograms[i]);
+            continue;
+        }
+
+        delta = current->histograms[i];
+        delta.count -= previous.histograms[i].count;
+        delta.max = 0;
+        for (int j = 0; j < STATS_BUCKETS; j++)
+        {
+            delta.buckets[j] -= previous.histograms[i].buckets[j];
+            if (delta.buckets[j] > 0)
+                delta.max = stats_bucket_value(j);
+        }
+        print_histogram(stage_names[i], &delta);
+    }
+
+    print_clients(current);
+    fflush(stdout);
+}
+
+/**
+ * @brief Entry point of kpstat, which watches a running server's statistics.
+ * @param argc The number of command-line arguments.
+ * @param argv An array of strings containing the command-line arguments.
+ *             It may have: [-i interval_seconds] [-a] [-1].
+ * @return 0 on success, 1 on incorrect arguments or if no server is running.
+ */
+int main(int argc, char *argv[])
+{
+    const struct stats_segment *segment;
+    static struct stats_segment current;
+    int interval = KPSTAT_INTERVAL;
+    int all_time = 0;
+    int once = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:a1")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'a':
+            all_time = 1;
+            break;
+        case '1':
+            once = 1;
+            all_time = 1;
+            break;
+        default:
+            interval = 0;
+            break;
+        }
+    }
+
+    if (interval <= 0 || optind != argc)
+    {
+        bold_yellow();
+        printf("⭐ Usage: %s [-i interval_seconds] [-a] [-1]\n", argv[0]);
+        default_color();
+        return 1;
+    }
+
+    segment = attach();
+    if (segment == NULL || __atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+        segment->version != STATS_VERSION)
+    {
+        bold_red();
+        printf("⛔ No running server found (%s).\n", STATS_NAME);
+        default_color();
+        return 1;
+    }
+
+    memcpy(&previous, segment, sizeof(previous));
+
+    while (1)
+    {
+        if (!once)
+            sleep(interval);
+
+        memcpy(&current, segment, sizeof(current));
+        print_stats(&current, all_time);
+        memcpy(&previous, &current, sizeof(previous));
+
+        if (once)
+            break;
+    }
+
+    return 0;
+}
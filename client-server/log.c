@@ -0,0 +1,266 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* *********************************
+    Asynchronous logger
+************************************ */
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO // Levels above this are compiled out
+#endif
+
+#define LOG_RING_SIZE 4096     // Records in the ring, a power of two
+#define LOG_ARGS 4             // Numeric arguments a record can carry
+#define LOG_TEXT_SIZE 48       // Bytes of the string argument kept in a record
+#define LOG_BATCH_SIZE 65536   // Bytes formatted before each write()
+#define LOG_IDLE_US 2000       // Logger thread sleep when the ring is empty
+
+/**
+ * A fixed-size log entry. Producers only copy values in; the format string is a
+ * literal and is expanded later by the logger thread.
+ */
+struct log_record
+{
+    uint64_t seq;              // Ring sequence number, see log_push()
+    uint64_t time_ns;          // When the record was produced
+    const char *fmt;           // printf format: %s first if there is text, %ld for numbers
+    int level;                 // LOG_LEVEL_* of the record
+    int tid;                   // Thread that produced it
+    long args[LOG_ARGS];       // Numeric arguments
+    int has_text;              // Whether text is an argument of fmt
+    char text[LOG_TEXT_SIZE];  // String argument, truncated
+};
+
+static struct log_record log_ring[LOG_RING_SIZE];
+static uint64_t log_tail;      // Next sequence to claim, shared by the producers
+static uint64_t log_head;      // Next sequence to read, owned by the logger thread
+static uint64_t log_dropped;   // Records lost because the ring was full
+static int log_color;          // Whether stdout is a terminal
+static pthread_t log_thread;
+static __thread int log_tid;
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define log_error(fmt, ...) log_push(LOG_LEVEL_ERROR, NULL, fmt, (long[LOG_ARGS]){__VA_ARGS__})
+#define log_error_s(fmt, text, ...) log_push(LOG_LEVEL_ERROR, text, fmt, (long[LOG_ARGS]){__VA_ARGS__})
+#else
+#define log_error(fmt, ...) ((void)0)
+#define log_error_s(fmt, text, ...) ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define log_warn(fmt, ...) log_push(LOG_LEVEL_WARN, NULL, fmt, (long[LOG_ARGS]){__VA_ARGS__})
+#define log_warn_s(fmt, text, ...) log_push(LOG_LEVEL_WARN, text, fmt, (long[LOG_ARGS]){__VA_ARGS__})
+#else
+#define log_warn(fmt, ...) ((void)0)
+#define log_warn_s(fmt, text, ...) ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define log_info(fmt, ...) log_push(LOG_LEVEL_INFO, NULL, fmt, (long[LOG_ARGS]){__VA_ARGS__})
+#define log_info_s(fmt, text, ...) log_push(LOG_LEVEL_INFO, text, fmt, (long[LOG_ARGS]){__VA_ARGS__})
+#else
+#define log_info(fmt, ...) ((void)0)
+#define log_info_s(fmt, text, ...) ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define log_debug(fmt, ...) log_push(LOG_LEVEL_DEBUG, NULL, fmt, (long[LOG_ARGS]){__VA_ARGS__})
+#define log_debug_s(fmt, text, ...) log_push(LOG_LEVEL_DEBUG, text, fmt, (long[LOG_ARGS]){__VA_ARGS__})
+#else
+#define log_debug(fmt, ...) ((void)0)
+#define log_debug_s(fmt, text, ...) ((void)0)
+#endif
+
+/**
+ * @brief Appends a record to the ring without locking or blocking. Each slot carries
+ *        a sequence number: a producer claims a slot by advancing the tail, fills it and
+ *        then publishes it by bumping its sequence. If the ring is full the record is
+ *        dropped and counted.
+ * @param level The LOG_LEVEL_* of the record.
+ * @param text An optional string argument, copied into the record, or NULL. It must be
+ *             the first conversion of fmt.
+ * @param fmt A format literal; numeric conversions must be %ld.
+ * @param args LOG_ARGS numeric arguments.
+ */
+void log_push(int level, const char *text, const char *fmt, const long *args)
+{
+    struct log_record *record;
+    struct timespec now;
+    uint64_t pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+    uint64_t seq;
+
+    while (1)
+    {
+        record = &log_ring[pos & (LOG_RING_SIZE - 1)];
+        seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos)
+        {
+            if (__atomic_compare_exchange_n(&log_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if ((int64_t)(seq - pos) < 0)
+        {
+            __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else
+        {
+            pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (log_tid == 0)
+        log_tid = gettid();
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    record->time_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record->fmt = fmt;
+    record->level = level;
+    record->tid = log_tid;
+    memcpy(record->args, args, sizeof(record->args));
+    record->has_text = text != NULL;
+    if (text != NULL)
+    {
+        strncpy(record->text, text, LOG_TEXT_SIZE - 1);
+        record->text[LOG_TEXT_SIZE - 1] = '\0';
+    }
+
+    __atomic_store_n(&record->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Formats one record as a line, with ANSI colors when stdout is a terminal.
+ * @return The number of bytes written to buf.
+ */
+static int log_format(const struct log_record *record, char *buf, size_t size)
+{
+    static const char *level_colors[] = {"", "\033[1;31m", "\033[1;33m", "\033[1;37m", "\033[0;37m"};
+    time_t seconds = record->time_ns / 1000000000ULL;
+    struct tm tm;
+    int n;
+
+    localtime_r(&seconds, &tm);
+
+    n = snprintf(buf, size, "%s%02d:%02d:%02d.%03d [TID : %d]%s ",
+                 log_color ? "\033[1;36m" : "", tm.tm_hour, tm.tm_min, tm.tm_sec,
+                 (int)(record->time_ns / 1000000 % 1000), record->tid,
+                 log_color ? level_colors[record->level] : "");
+
+    // Arguments the format does not use are simply ignored
+    if (record->has_text)
+        n += snprintf(buf + n, size - n, record->fmt, record->text, record->args[0],
+                      record->args[1], record->args[2], record->args[3]);
+    else
+        n += snprintf(buf + n, size - n, record->fmt, record->args[0], record->args[1],
+                      record->args[2], record->args[3]);
+
+    n += snprintf(buf + n, size - n, "%s\n", log_color ? "\033[0m" : "");
+    return n < (int)size ? n : (int)size - 1;
+}
+
+/**
+ * @brief Formats every published record into batches and writes them to stdout.
+ * @return The number of records written.
+ */
+static int log_drain()
+{
+    static char batch[LOG_BATCH_SIZE];
+    struct log_record *record;
+    uint64_t dropped;
+    size_t used = 0;
+    int count = 0;
+
+    while (1)
+    {
+        record = &log_ring[log_head & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != log_head + 1)
+            break;
+
+        if (LOG_BATCH_SIZE - used < 512)
+        {
+            write(STDOUT_FILENO, batch, used);
+            used = 0;
+        }
+        used += log_format(record, batch + used, LOG_BATCH_SIZE - used);
+
+        // Hand the slot back to the producers for the next lap
+        __atomic_store_n(&record->seq, log_head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        __atomic_store_n(&log_head, log_head + 1, __ATOMIC_RELEASE);
+        count++;
+    }
+
+    dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0)
+        used += snprintf(batch + used, LOG_BATCH_SIZE - used, "%s⛔ log ring full, %lu records lost%s\n",
+                         log_color ? "\033[1;31m" : "", (unsigned long)dropped, log_color ? "\033[0m" : "");
+
+    if (used > 0)
+        write(STDOUT_FILENO, batch, used);
+    return count;
+}
+
+/**
+ * @brief Logger thread body: drains the ring and naps while it is empty.
+ */
+static void *log_consumer(void *arg)
+{
+    struct timespec idle = {0, LOG_IDLE_US * 1000L};
+
+    (void)arg;
+
+    while (1)
+    {
+        if (log_drain() == 0)
+            nanosleep(&idle, NULL);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Prepares the ring and starts the logger thread.
+ * @return 0 on success, -1 on failure.
+ */
+int log_start()
+{
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++)
+        log_ring[i].seq = i;
+
+    log_color = isatty(STDOUT_FILENO);
+
+    // Anything printed before the logger started must come out first
+    fflush(stdout);
+
+    if (LOG_LEVEL == LOG_LEVEL_NONE)
+        return 0;
+    if (pthread_create(&log_thread, NULL, log_consumer, NULL) != 0)
+        return -1;
+    pthread_detach(log_thread);
+    return 0;
+}
+
+/**
+ * @brief Gives the logger thread a moment to write out what is still in the ring,
+ *        before the program exits.
+ */
+void log_flush()
+{
+    struct timespec idle = {0, LOG_IDLE_US * 1000L};
+
+    if (LOG_LEVEL == LOG_LEVEL_NONE)
+        return;
+
+    for (int i = 0; i < 50 && __atomic_load_n(&log_head, __ATOMIC_ACQUIRE) != __atomic_load_n(&log_tail, __ATOMIC_RELAXED); i++)
+        nanosleep(&idle, NULL);
+}
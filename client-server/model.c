@@ -0,0 +1,281 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* *********************************
+    Duration model
+************************************ */
+
+#define MODEL_ROWS 4
+#define MODEL_COLS 3
+#define MODEL_HEIGHT_MAX 100   // pos_UD_height_max in the sketch
+#define MODEL_START_ROW 1      // current_position after power-on or a size change
+#define MODEL_START_COL 1
+#define MODEL_REST_ROW 3       // Where a key sequence leaves the robot: on the enter key
+#define MODEL_REST_COL 2
+
+/**
+ * Constants of the robot's timing, as in the sketch.
+ */
+struct model
+{
+    double step_ms;   // Move to another key, both axes at once (mov_speed)
+    double degree_ms; // One degree of the press stroke, on average over the sketch's default press profile
+    double key_ms;    // Fixed cost of a key: serial transfer, printing, and the profile's ramps and slow touch
+    double size_ms;   // Size change: the delay after move_to_start plus set_size_*
+};
+
+/**
+ * Where the robot is on the keypad (current_position in the sketch).
+ */
+struct model_position
+{
+    int row;
+    int col;
+};
+
+/**
+ * What a command makes the robot do, in the units of the model's constants.
+ */
+struct model_features
+{
+    double steps;   // Moves to another key
+    double degrees; // Degrees of press strokes
+    double keys;    // Keys pressed
+    double sizes;   // Size changes
+};
+
+static const char model_keypad[MODEL_ROWS][MODEL_COLS] = {
+    {'1', '2', '3'},
+    {'4', '5', '6'},
+    {'7', '8', '9'},
+    {'d', '0', 'r'}};
+
+static const int model_touch[MODEL_ROWS] = {80, 64, 52, 39}; // pos_UD_height_touch per row
+
+/**
+ * @brief Returns the model with the sketch's constants.
+ */
+struct model model_default()
+{
+    struct model model = {500, 1.6, 55, 3400};
+
+    return model;
+}
+
+/**
+ * @brief Adds the work of pressing one key to a command's features and moves the robot.
+ */
+static void model_key(struct model_position *position, char key, struct model_features *features)
+{
+    int touch;
+
+    for (int row = 0; row < MODEL_ROWS; row++)
+    {
+        for (int col = 0; col < MODEL_COLS; col++)
+        {
+            if (model_keypad[row][col] != key)
+                continue;
+
+            // The delete key is pressed two degrees higher
+            touch = model_touch[row] + (row == 3 && col == 0 ? 2 : 0);
+
+            // The sketch drives both axes straight to the key and waits for them once
+            features->steps += row != position->row || col != position->col;
+            features->degrees += 1 + 2 * (MODEL_HEIGHT_MAX - touch + 1);
+            features->keys += 1;
+            position->row = row;
+            position->col = col;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Works out what a command makes the robot do, starting from a position.
+ * @param position Where the robot is; moved to where the command leaves it.
+ * @param cmd The command.
+ * @param features Accumulates the command's features.
+ */
+void model_features(struct model_position *position, const struct command *cmd, struct model_features *features)
+{
+    if (cmd->type == CMD_SIZE)
+    {
+        features->sizes += 1;
+        position->row = MODEL_START_ROW;
+        position->col = MODEL_START_COL;
+        return;
+    }
+
+    // The library frames every sequence with a delete and an enter press
+    model_key(position, 'd', features);
+    for (int i = 0; i < cmd->len; i++)
+    {
+        if (cmd->keys[i] != ' ')
+            model_key(position, cmd->keys[i], features);
+    }
+    model_key(position, 'r', features);
+}
+
+/**
+ * @brief Returns how long features take with a model's constants, in milliseconds.
+ */
+double model_cost(const struct model *model, const struct model_features *features)
+{
+    return features->steps * model->step_ms + features->degrees * model->degree_ms + features->keys * model->key_ms +
+           features->sizes * model->size_ms;
+}
+
+/**
+ * @brief Predicts how long the robot takes to carry out a command.
+ * @param model The model.
+ * @param position Where the robot is; moved to where the command leaves it.
+ * @param cmd The command.
+ * @return The predicted time in milliseconds.
+ */
+int model_predict(const struct model *model, struct model_position *position, const struct command *cmd)
+{
+    struct model_features features = {0, 0, 0, 0};
+
+    model_features(position, cmd, &features);
+    return (int)(model_cost(model, &features) + 0.5);
+}
+
+/**
+ * @brief Predicts how long a command takes without knowing where the robot is, as if
+ *        it were resting after an earlier key sequence.
+ */
+int model_estimate(const struct model *model, const struct command *cmd)
+{
+    struct model_position position = {MODEL_REST_ROW, MODEL_REST_COL};
+
+    return model_predict(model, &position, cmd);
+}
+
+/**
+ * @brief Reads model constants given as name=value pairs separated by commas, such as
+ *        step=500,degree=1.6,key=55,size=3400. Constants not given keep their value.
+ * @return 0 on success, -1 if the list is malformed.
+ */
+int model_parse(struct model *model, const char *spec)
+{
+    char name[16];
+    double value;
+    int used;
+
+    while (*spec != '\0')
+    {
+        if (sscanf(spec, "%15[^=]=%lf%n", name, &value, &used) != 2 || value < 0)
+            return -1;
+
+        if (strcmp(name, "step") == 0)
+            model->step_ms = value;
+        else if (strcmp(name, "degree") == 0)
+            model->degree_ms = value;
+        else if (strcmp(name, "key") == 0)
+            model->key_ms = value;
+        else if (strcmp(name, "size") == 0)
+            model->size_ms = value;
+        else
+            return -1;
+
+        spec += used;
+        if (*spec == ',')
+            spec++;
+        else if (*spec != '\0')
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Fits the model's constants to measured durations by least squares.
+ * @param model Receives the constants. A constant no sample says anything about keeps
+ *              its value.
+ * @param features The features of each measured command.
+ * @param measured_ms The measured duration of each command.
+ * @param count The number of samples.
+ * @return 0 on success, -1 if the samples can't separate the constants.
+ */
+int model_fit(struct model *model, const struct model_features *features, const double *measured_ms, int count)
+{
+    double *constants[4] = {&model->step_ms, &model->degree_ms, &model->key_ms, &model->size_ms};
+    double a[4][5] = {{0}};
+    double x[4];
+    double row[4];
+    int used[4] = {0};
+    int index[4];
+    int n = 0;
+    int pivot;
+    double swap, factor;
+
+    for (int s = 0; s < count; s++)
+    {
+        used[0] |= features[s].steps != 0;
+        used[1] |= features[s].degrees != 0;
+        used[2] |= features[s].keys != 0;
+        used[3] |= features[s].sizes != 0;
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        if (used[i])
+            index[n++] = i;
+    }
+
+    // Normal equations over the constants the samples use
+    for (int s = 0; s < count; s++)
+    {
+        double all[4] = {features[s].steps, features[s].degrees, features[s].keys, features[s].sizes};
+        double target = measured_ms[s];
+
+        for (int i = 0; i < n; i++)
+            row[i] = all[index[i]];
+
+        for (int i = 0; i < n; i++)
+        {
+            for (int j = 0; j < n; j++)
+                a[i][j] += row[i] * row[j];
+            a[i][n] += row[i] * target;
+        }
+    }
+
+    // Gaussian elimination with partial pivoting
+    for (int i = 0; i < n; i++)
+    {
+        pivot = i;
+        for (int j = i + 1; j < n; j++)
+        {
+            if (fabs(a[j][i]) > fabs(a[pivot][i]))
+                pivot = j;
+        }
+        if (fabs(a[pivot][i]) < 1e-9)
+            return -1;
+
+        for (int k = 0; k <= n; k++)
+        {
+            swap = a[i][k];
+            a[i][k] = a[pivot][k];
+            a[pivot][k] = swap;
+        }
+        for (int j = 0; j < n; j++)
+        {
+            if (j == i)
+                continue;
+            factor = a[j][i] / a[i][i];
+            for (int k = i; k <= n; k++)
+                a[j][k] -= factor * a[i][k];
+        }
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        x[i] = a[i][n] / a[i][i];
+        if (x[i] < 0)
+            x[i] = 0;
+    }
+    for (int i = 0; i < n; i++)
+        *constants[index[i]] = x[i];
+
+    return 0;
+}
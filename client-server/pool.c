@@ -0,0 +1,183 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+/* *********************************
+    Worker pool
+************************************ */
+
+#define POOL_WORKERS 4          // Default number of worker threads
+#define POOL_QUEUE_DEPTH 1024   // Default capacity of the job queue
+#define JOB_DATA_SIZE 1024      // Largest datagram a job can hold
+
+/**
+ * A received datagram waiting to be processed by a worker.
+ */
+struct job
+{
+    char data[JOB_DATA_SIZE + 1]; // Datagram payload (null-terminated)
+    int len;                      // Payload length in bytes
+    struct sockaddr_in addr;      // Sender address
+    unsigned long ticket;         // Arrival order of the datagram
+    uint64_t received_ns;         // When it was received, from stats_now()
+};
+
+/**
+ * Bounded FIFO of jobs shared between the receiver and the workers. The receiver
+ * writes datagrams straight into free slots of the ring, so nothing is copied.
+ */
+struct job_queue
+{
+    struct job *jobs;          // Ring of job slots
+    int depth;                 // Number of slots in the ring
+    int head;                  // Index of the oldest job
+    int count;                 // Number of queued jobs
+    unsigned long full_waits;  // Times the receiver found the queue full
+    unsigned long next_ticket; // Ticket given to the next accepted job
+    pthread_mutex_t lock;      // Protects the ring indexes
+    pthread_cond_t not_empty;  // Signaled when a job is pushed
+    pthread_cond_t not_full;   // Signaled when a job is taken
+};
+
+static struct job_queue pool_queue;
+static pthread_t *pool_threads;
+static void (*pool_handler)(struct job *job);
+
+/**
+ * @brief Reserves free job slots for the receiver to fill in place. The slots are
+ *        contiguous in the ring, so fewer than requested may be returned near its end.
+ *        Blocks while the queue is full. Only one thread may reserve at a time.
+ * @param slots Set to the first reserved slot.
+ * @param max The maximum number of slots wanted.
+ * @return The number of slots reserved, at least 1.
+ */
+int pool_reserve(struct job **slots, int max)
+{
+    int tail;
+    int free_slots;
+
+    pthread_mutex_lock(&pool_queue.lock);
+    while (pool_queue.count == pool_queue.depth)
+    {
+        pool_queue.full_waits++;
+        pthread_cond_wait(&pool_queue.not_full, &pool_queue.lock);
+    }
+
+    tail = (pool_queue.head + pool_queue.count) % pool_queue.depth;
+    free_slots = pool_queue.depth - pool_queue.count;
+    pthread_mutex_unlock(&pool_queue.lock);
+
+    if (free_slots > pool_queue.depth - tail)
+        free_slots = pool_queue.depth - tail;
+    if (free_slots > max)
+        free_slots = max;
+
+    *slots = &pool_queue.jobs[tail];
+    return free_slots;
+}
+
+/**
+ * @brief Publishes slots previously returned by pool_reserve() to the workers.
+ * @param count The number of reserved slots that were filled.
+ */
+void pool_commit(int count)
+{
+    int tail;
+
+    if (count <= 0)
+        return;
+
+    pthread_mutex_lock(&pool_queue.lock);
+    tail = (pool_queue.head + pool_queue.count) % pool_queue.depth;
+    for (int i = 0; i < count; i++)
+        pool_queue.jobs[tail + i].ticket = pool_queue.next_ticket++;
+    pool_queue.count += count;
+    stats_set(jobs_queued, pool_queue.count);
+
+    pthread_cond_broadcast(&pool_queue.not_empty);
+    pthread_mutex_unlock(&pool_queue.lock);
+}
+
+/**
+ * @brief Returns how many times the receiver had to wait for a free slot.
+ */
+unsigned long pool_full_waits()
+{
+    unsigned long waits;
+
+    pthread_mutex_lock(&pool_queue.lock);
+    waits = pool_queue.full_waits;
+    pthread_mutex_unlock(&pool_queue.lock);
+    return waits;
+}
+
+/**
+ * @brief Worker thread body: takes jobs off the queue and hands them to the handler.
+ *        The job is copied out of the ring so the slot can be reused while it is processed.
+ */
+static void *pool_worker(void *arg)
+{
+    struct job job;
+
+    (void)arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&pool_queue.lock);
+        while (pool_queue.count == 0)
+            pthread_cond_wait(&pool_queue.not_empty, &pool_queue.lock);
+
+        job = pool_queue.jobs[pool_queue.head];
+        pool_queue.head = (pool_queue.head + 1) % pool_queue.depth;
+        pool_queue.count--;
+        stats_set(jobs_queued, pool_queue.count);
+        pthread_cond_signal(&pool_queue.not_full);
+        pthread_mutex_unlock(&pool_queue.lock);
+
+        pool_handler(&job);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Allocates the job queue and starts the worker threads.
+ * @param workers The number of worker threads to start.
+ * @param depth The capacity of the job queue, which is also the receive ring.
+ * @param handler The function called by a worker for every job.
+ * @return 0 on success, -1 on failure.
+ */
+int pool_start(int workers, int depth, void (*handler)(struct job *job))
+{
+    pool_queue.jobs = (struct job *)calloc(depth, sizeof(struct job));
+    pool_threads = (pthread_t *)calloc(workers, sizeof(pthread_t));
+    if (pool_queue.jobs == NULL || pool_threads == NULL)
+    {
+        free(pool_queue.jobs);
+        free(pool_threads);
+        return -1;
+    }
+
+    pool_queue.depth = depth;
+    pool_queue.head = 0;
+    pool_queue.count = 0;
+    pool_queue.full_waits = 0;
+    pool_queue.next_ticket = 0;
+    pthread_mutex_init(&pool_queue.lock, NULL);
+    pthread_cond_init(&pool_queue.not_empty, NULL);
+    pthread_cond_init(&pool_queue.not_full, NULL);
+
+    pool_handler = handler;
+
+    for (int i = 0; i < workers; i++)
+    {
+        if (pthread_create(&pool_threads[i], NULL, pool_worker, NULL) != 0)
+            return -1;
+        pthread_detach(pool_threads[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,208 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/* *********************************
+    Binary wire format
+************************************ */
+
+#define PROTO_MAGIC 0x4b        // First byte of every frame; never starts a legacy text datagram
+#define PROTO_VERSION 1         // Version of the frame layout
+#define PROTO_HEADER_SIZE 20    // Bytes of the header on the wire
+#define PROTO_MAX_PAYLOAD 1000  // Largest payload, so a frame fits a job slot
+#define PROTO_LEGACY -1         // proto_decode(): not a frame, a legacy text datagram
+#define PROTO_CORRUPT -2        // proto_decode(): a frame with a bad version, length or CRC
+#define PROTO_TTL_UNIT_MS 10    // Unit of the ttl field
+
+/**
+ * Frame opcodes. Requests go from the client to the server, replies the other way.
+ */
+enum proto_opcode
+{
+    PROTO_PRESS = 1,    // Press keys: one byte per key, 0 to 9
+    PROTO_SET_SIZE = 2, // Change the keyboard size: one byte, enum proto_size
+    PROTO_BATCH = 3,    // Several PRESS and SET_SIZE operations: opcode(1) length(1) payload, repeated
+    PROTO_PING = 4,     // No payload; answered with an ACK
+    PROTO_ACK = 0x81,   // The frame was accepted (or already had been)
+    PROTO_NACK = 0x82,  // The frame was rejected and must not be resent
+    PROTO_BUSY = 0x83,  // The robot's queue is full: 4 bytes, milliseconds to wait before resending
+    PROTO_EXPIRED = 0x84 // An accepted frame's deadline passed before the robot got to it
+};
+
+/**
+ * Keyboard sizes carried by SET_SIZE.
+ */
+enum proto_size
+{
+    PROTO_SIZE_SMALL = 0,  // 's'
+    PROTO_SIZE_MEDIUM = 1, // 'm'
+    PROTO_SIZE_BIG = 2     // 'b'
+};
+
+/**
+ * Header that precedes the payload of a frame. On the wire every field is in network
+ * byte order: magic(1) version(1) opcode(1) flags(1) session(4) seq(4) length(2)
+ * ttl(2) crc(4). The CRC-32 covers the header, with crc set to 0, and the payload.
+ * The payload is ROT128 encrypted, like the legacy text datagrams.
+ */
+struct proto_header
+{
+    uint8_t magic;    // PROTO_MAGIC
+    uint8_t version;  // PROTO_VERSION
+    uint8_t opcode;   // enum proto_opcode
+    uint8_t flags;    // Reserved, 0
+    uint32_t session; // Random per client run, so a restarted client starts a fresh window
+    uint32_t seq;     // Sequence number of the frame within the session
+    uint16_t length;  // Payload length in bytes
+    uint16_t ttl;     // Deadline in PROTO_TTL_UNIT_MS after the server receives the frame, 0 for the server default
+    uint32_t crc;     // CRC-32 of the frame
+};
+
+/**
+ * @brief Updates a CRC-32 (IEEE 802.3, reflected) with a buffer, four bits at a time
+ *        from a 16 entry table so there is nothing to initialise.
+ * @param crc The CRC so far, 0 to start.
+ * @param data The bytes to add.
+ * @param len The number of bytes.
+ * @return The updated CRC.
+ */
+uint32_t proto_crc32(uint32_t crc, const void *data, size_t len)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+    const unsigned char *in = (const unsigned char *)data;
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc = table[(crc ^ in[i]) & 0x0f] ^ (crc >> 4);
+        crc = table[(crc ^ (in[i] >> 4)) & 0x0f] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+/**
+ * @brief Writes the header fields, with the CRC given, to a buffer.
+ */
+static void proto_write_header(char *buf, const struct proto_header *header, uint32_t crc)
+{
+    uint32_t session = htonl(header->session);
+    uint32_t seq = htonl(header->seq);
+    uint16_t length = htons(header->length);
+    uint16_t ttl = htons(header->ttl);
+
+    crc = htonl(crc);
+    buf[0] = (char)PROTO_MAGIC;
+    buf[1] = (char)PROTO_VERSION;
+    buf[2] = (char)header->opcode;
+    buf[3] = (char)header->flags;
+    memcpy(buf + 4, &session, sizeof(session));
+    memcpy(buf + 8, &seq, sizeof(seq));
+    memcpy(buf + 12, &length, sizeof(length));
+    memcpy(buf + 14, &ttl, sizeof(ttl));
+    memcpy(buf + 16, &crc, sizeof(crc));
+}
+
+/**
+ * @brief Builds a frame.
+ * @param buf Receives the frame; room for PROTO_HEADER_SIZE + header->length bytes.
+ * @param header The header; its length says how many payload bytes there are.
+ * @param payload The payload, already encrypted. May be NULL if length is 0.
+ * @return The frame length in bytes.
+ */
+size_t proto_encode(char *buf, const struct proto_header *header, const void *payload)
+{
+    if (header->length > 0)
+        memcpy(buf + PROTO_HEADER_SIZE, payload, header->length);
+
+    proto_write_header(buf, header, 0);
+    proto_write_header(buf, header, proto_crc32(0, buf, PROTO_HEADER_SIZE + header->length));
+    return PROTO_HEADER_SIZE + header->length;
+}
+
+/**
+ * @brief Reads and checks the header of a datagram.
+ * @param buf The datagram.
+ * @param len The datagram length in bytes.
+ * @param header Filled with the header.
+ * @return The header size, so the payload starts at buf + the result, PROTO_LEGACY if
+ *         the datagram is not a frame, or PROTO_CORRUPT if it is a damaged or unknown one.
+ */
+int proto_decode(const char *buf, size_t len, struct proto_header *header)
+{
+    static const char zero[4];
+    uint32_t session, seq, crc;
+    uint16_t length, ttl;
+
+    if (len < PROTO_HEADER_SIZE || (uint8_t)buf[0] != PROTO_MAGIC)
+        return PROTO_LEGACY;
+    if ((uint8_t)buf[1] != PROTO_VERSION)
+        return PROTO_CORRUPT;
+
+    memcpy(&session, buf + 4, sizeof(session));
+    memcpy(&seq, buf + 8, sizeof(seq));
+    memcpy(&length, buf + 12, sizeof(length));
+    memcpy(&ttl, buf + 14, sizeof(ttl));
+    memcpy(&crc, buf + 16, sizeof(crc));
+
+    header->magic = PROTO_MAGIC;
+    header->version = PROTO_VERSION;
+    header->opcode = (uint8_t)buf[2];
+    header->flags = (uint8_t)buf[3];
+    header->session = ntohl(session);
+    header->seq = ntohl(seq);
+    header->length = ntohs(length);
+    header->ttl = ntohs(ttl);
+    header->crc = ntohl(crc);
+
+    if (header->length > PROTO_MAX_PAYLOAD || PROTO_HEADER_SIZE + (size_t)header->length != len)
+        return PROTO_CORRUPT;
+
+    crc = proto_crc32(0, buf, 16);
+    crc = proto_crc32(crc, zero, sizeof(zero));
+    crc = proto_crc32(crc, buf + PROTO_HEADER_SIZE, header->length);
+    if (crc != header->crc)
+        return PROTO_CORRUPT;
+
+    return PROTO_HEADER_SIZE;
+}
+
+/**
+ * @brief Reads the next operation of a frame's payload. A PRESS or SET_SIZE frame is a
+ *        single operation; a BATCH frame is a list of them.
+ * @param header The frame header.
+ * @param payload The frame payload.
+ * @param offset Where to read from, 0 to start; advanced past the operation.
+ * @param opcode Receives PROTO_PRESS or PROTO_SET_SIZE.
+ * @param op Receives the operation's payload.
+ * @param op_len Receives the operation's payload length.
+ * @return 1 if an operation was read, 0 at the end, -1 if the payload is malformed.
+ */
+int proto_next_op(const struct proto_header *header, const char *payload, size_t *offset,
+                  uint8_t *opcode, const char **op, size_t *op_len)
+{
+    if (*offset >= header->length)
+        return 0;
+
+    if (header->opcode != PROTO_BATCH)
+    {
+        *opcode = header->opcode;
+        *op = payload;
+        *op_len = header->length;
+        *offset = header->length;
+        return 1;
+    }
+
+    if (*offset + 2 > header->length)
+        return -1;
+
+    *opcode = (uint8_t)payload[*offset];
+    *op_len = (uint8_t)payload[*offset + 1];
+    *op = payload + *offset + 2;
+    *offset += 2 + *op_len;
+    if (*offset > header->length || (*opcode != PROTO_PRESS && *opcode != PROTO_SET_SIZE))
+        return -1;
+    return 1;
+}
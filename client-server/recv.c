@@ -0,0 +1,195 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/* *********************************
+    Receive engine
+************************************ */
+
+#define RECV_BATCH 32                      // Default datagrams drained per recvmmsg()
+#define RECV_SOCKET_BUFFER (4 * 1024 * 1024) // Kernel receive buffer requested for the socket
+#define RECV_CONTROL_SIZE CMSG_SPACE(sizeof(uint32_t))
+
+static struct mmsghdr *recv_msgs;     // One header per datagram of a batch
+static struct iovec *recv_iovs;       // One buffer per datagram of a batch
+static char (*recv_control)[RECV_CONTROL_SIZE]; // Ancillary data per datagram
+static int recv_batch;                // Datagrams drained per recvmmsg()
+static int recv_epfd;                 // Epoll instance watching the socket
+static uint32_t recv_drops;           // Datagrams the kernel dropped (SO_RXQ_OVFL)
+
+/**
+ * @brief Returns the number of datagrams the kernel dropped because the socket
+ *        buffer was full, as last reported by SO_RXQ_OVFL.
+ */
+unsigned long recv_kernel_drops()
+{
+    return __atomic_load_n(&recv_drops, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Prepares the socket and the batch buffers for the receive loop.
+ * @param fd The bound UDP socket.
+ * @param batch The maximum number of datagrams drained per recvmmsg() call.
+ * @return 0 on success, -1 on failure.
+ */
+int recv_start(int fd, int batch)
+{
+    struct epoll_event event;
+    int one = 1;
+    int size = RECV_SOCKET_BUFFER;
+
+    recv_msgs = (struct mmsghdr *)calloc(batch, sizeof(struct mmsghdr));
+    recv_iovs = (struct iovec *)calloc(batch, sizeof(struct iovec));
+    recv_control = calloc(batch, RECV_CONTROL_SIZE);
+    if (recv_msgs == NULL || recv_iovs == NULL || recv_control == NULL)
+        return -1;
+    recv_batch = batch;
+
+    // Ask for a large socket buffer to absorb bursts; FORCE works when running as root
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    // Have the kernel report how many datagrams it dropped
+    if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) < 0)
+        return -1;
+
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+        return -1;
+
+    recv_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (recv_epfd < 0)
+        return -1;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    return epoll_ctl(recv_epfd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/**
+ * @brief Reads the kernel drop counter from the ancillary data of a datagram.
+ */
+static void recv_update_drops(struct msghdr *msg)
+{
+    struct cmsghdr *cmsg;
+    uint32_t drops;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+        {
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            if (drops != recv_drops)
+            {
+                log_warn("kernel dropped %ld datagrams so far", (long)drops);
+                __atomic_store_n(&recv_drops, drops, __ATOMIC_RELAXED);
+                stats_set(kernel_drops, drops);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Drains the socket straight into the job queue, a batch per recvmmsg() call.
+ * @param fd The non-blocking UDP socket.
+ * @return 0 once the socket has no more datagrams, -1 on error.
+ */
+static int recv_drain(int fd)
+{
+    struct job *slots;
+    uint64_t now;
+    int count;
+    int kept;
+    int n;
+
+    while (1)
+    {
+        count = pool_reserve(&slots, recv_batch);
+
+        for (int i = 0; i < count; i++)
+        {
+            recv_iovs[i].iov_base = slots[i].data;
+            recv_iovs[i].iov_len = JOB_DATA_SIZE;
+
+            memset(&recv_msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+            recv_msgs[i].msg_hdr.msg_name = &slots[i].addr;
+            recv_msgs[i].msg_hdr.msg_namelen = sizeof(slots[i].addr);
+            recv_msgs[i].msg_hdr.msg_iov = &recv_iovs[i];
+            recv_msgs[i].msg_hdr.msg_iovlen = 1;
+            recv_msgs[i].msg_hdr.msg_control = recv_control[i];
+            recv_msgs[i].msg_hdr.msg_controllen = RECV_CONTROL_SIZE;
+        }
+
+        n = recvmmsg(fd, recv_msgs, count, MSG_DONTWAIT, NULL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        now = stats_now();
+        kept = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if (recv_msgs[i].msg_hdr.msg_controllen > 0)
+                recv_update_drops(&recv_msgs[i].msg_hdr);
+
+            // A datagram longer than a slot would be parsed cut short: drop it, closing the gap
+            if (recv_msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+            {
+                stats_add(truncated, 1);
+                continue;
+            }
+            if (kept != i)
+                slots[kept] = slots[i];
+            slots[kept].received_ns = now;
+            slots[kept].len = recv_msgs[i].msg_len;
+            slots[kept].data[slots[kept].len] = '\0';
+            kept++;
+        }
+        pool_commit(kept);
+        stats_add(received, kept);
+
+        if (n < count)
+            return 0;
+    }
+}
+
+/**
+ * @brief Receive loop: waits on epoll until the socket is readable and drains it.
+ * @param fd The UDP socket prepared by recv_start().
+ */
+void recv_loop(int fd)
+{
+    struct epoll_event event;
+    int n;
+
+    while (1)
+    {
+        n = epoll_wait(recv_epfd, &event, 1, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            bold_red();
+            printf("\n⛔ Couldn't wait for messages.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (recv_drain(fd) < 0)
+        {
+            bold_red();
+            printf("\n⛔ Couldn't receive.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,10 +10,19 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <sys/stat.h>
-#include <semaphore.h>
 
 #include "colors.h"
+#include "log.c"
+#include "stats.c"
+#include "proto.c"
+#include "clients.c"
 #include "utils.c"
+#include "pool.c"
+#include "command.c"
+#include "model.c"
+#include "device.c"
+#include "recv.c"
+#include "uring.c"
 
 /* *********************************
     Variables and Constants
@@ -23,9 +33,7 @@
 int sockfd;                     // Global socket file descriptor
 struct sockaddr_in client_addr; // Global client address
 int len;                        // Global address length
-
-sem_t *sem_mutex;                    // Semaphore instance
-const char *sem_mutex_name = "/sem"; // Semaphore instance names
+long ttl_ms = DEVICE_TTL_MS;    // Deadline of commands that don't set one, 0 for none
 
 // sudo ufw allow 8080
 // sudo ufw enable
@@ -35,55 +43,6 @@ const char *sem_mutex_name = "/sem"; // Semaphore instance names
     Functions
 ************************************ */
 
-char *extractDigits(const char *entry)
-{
-    char *message = (char *)malloc(BUFFER_SIZE * sizeof(char));
-    int j = 0;
-
-    for (int i = 0; entry[i] != '\0'; i++)
-    {
-        if (isdigit(entry[i]) || entry[i] == ' ')
-        {
-            message[j] = entry[i];
-            j++;
-        }
-    }
-
-    return message;
-}
-
-char *extractLetters(const char *entry)
-{
-    char *message = (char *)malloc(BUFFER_SIZE * sizeof(char));
-    int j = 0;
-
-    for (int i = 0; entry[i] != '\0'; i++)
-    {
-        if (isalpha(entry[i]))
-        {
-            message[j] = entry[i];
-            j++;
-        }
-    }
-
-    return message;
-}
-
-/**
- * The function creates semaphores with specific names and permissions.
- */
-void create_semaphore()
-{
-    sem_mutex = sem_open(sem_mutex_name, O_CREAT, S_IRUSR | S_IWUSR, 1);
-    if (sem_mutex == SEM_FAILED)
-    {
-        bold_red();
-        perror("sem_open() failed");
-        default_color();
-        exit(EXIT_FAILURE);
-    }
-}
-
 /**
  * @brief The function handles shutting down the server by closing the socket and printing a message.
  * @param sig The parameter "sig" is an integer representing the signal number that caused the function
@@ -93,13 +52,11 @@ void create_semaphore()
 void handle_shut_down(int sig)
 {
 
-    // Destroy semaphore
-    sem_close(sem_mutex);
-    sem_unlink(sem_mutex_name);
-
     // Close the socket
     close(sockfd);
 
+    log_flush();
+    stats_stop();
     bold_yellow();
     printf("\nShutting down...\n");
     default_color();
@@ -112,7 +69,6 @@ void handle_shut_down(int sig)
  */
 void createServer(int port)
 {
-    int n;
     struct sockaddr_in server_addr;
     len = sizeof(client_addr);
 
@@ -147,178 +103,395 @@ void createServer(int port)
     bold_white();
     printf("\n💬 Listening... %d\n", port); // Print the port
     default_color();
+    fflush(stdout); // The logger writes to stdout directly from now on
 }
 
 /**
- * @brief Handles incoming messages from clients.
- * @param key The key used for message decryption.
+ * @brief Answers a frame with an ACK or a NACK.
+ * @param job The datagram being answered.
+ * @param header Its header.
+ * @param opcode PROTO_ACK or PROTO_NACK.
  */
-void handleMessage()
+void sendReply(const struct job *job, const struct proto_header *header, uint8_t opcode)
 {
-    int n;
-    char code[BUFFER_SIZE];
-    char *decrypted;
+    struct proto_header reply = {PROTO_MAGIC, PROTO_VERSION, opcode, 0, header->session, header->seq, 0, 0, 0};
+    char buf[PROTO_HEADER_SIZE];
 
-    while (1)
-    {
-
-        // Receive client's message:
-        n = recvfrom(sockfd, code, sizeof(code), 0, (struct sockaddr *)&client_addr, &len);
-        code[n] = '\0'; // Null-terminate the received message
-        if (n < 0)
-        {
-            bold_red();
-            printf("\n⛔ Couldn't receive.\n");
-            exit(EXIT_FAILURE);
-        }
-
-        // bold_cyan();
-        // printf("\n[FROM CLIENT] ");
-        // bold_red();
-        // printf("encrypted ");
-        // bold_white();
-        // printf("- %s\n", addSpaces(code));
-        // default_color();
+    proto_encode(buf, &reply, NULL);
+    sendto(sockfd, buf, sizeof(buf), MSG_DONTWAIT, (const struct sockaddr *)&job->addr, sizeof(job->addr));
+}
 
-        // Fork a new process
-        pid_t pid = fork();
+/**
+ * @brief Answers a frame with BUSY, telling the client when to send it again.
+ * @param job The datagram being answered.
+ * @param header Its header.
+ * @param retry_ms Milliseconds the client should wait before resending.
+ */
+void sendBusy(const struct job *job, const struct proto_header *header, long retry_ms)
+{
+    struct proto_header reply = {PROTO_MAGIC, PROTO_VERSION, PROTO_BUSY, 0, header->session, header->seq, 4, 0, 0};
+    uint32_t retry = htonl((uint32_t)retry_ms);
+    char buf[PROTO_HEADER_SIZE + 4];
 
-        if (pid < 0)
-        {
-            printf("\n⛔ Couldn't create child process.\n");
-            continue;
-        }
-        else if (pid == 0)
-        {
+    rot128_inplace((char *)&retry, sizeof(retry));
+    proto_encode(buf, &reply, &retry);
+    sendto(sockfd, buf, sizeof(buf), MSG_DONTWAIT, (const struct sockaddr *)&job->addr, sizeof(job->addr));
+}
 
-            int result;
+/**
+ * @brief Tells a client that a command it sent in a frame expired before the robot
+ *        got to it. Runs on a device consumer thread.
+ * @param cmd The expired command.
+ */
+void sendExpired(const struct device_cmd *cmd)
+{
+    struct proto_header reply = {PROTO_MAGIC, PROTO_VERSION, PROTO_EXPIRED, 0, cmd->session, cmd->seq, 0, 0, 0};
+    char buf[PROTO_HEADER_SIZE];
 
-            // Child process
-            decrypted = addSpaces(rot128(code));
+    if (!cmd->framed)
+        return;
 
-            if (decrypted == NULL)
-            {
-                printf("\n⛔ Decryption failed\n");
-                exit(EXIT_FAILURE);
-            }
+    proto_encode(buf, &reply, NULL);
+    sendto(sockfd, buf, sizeof(buf), MSG_DONTWAIT, (const struct sockaddr *)&cmd->addr, sizeof(cmd->addr));
+}
 
-            bold_cyan();
-            printf("\n[PID : %d] ", getpid());
-            bold_green();
-            printf("decrypted ");
-            bold_white();
-            printf("- %s\n", decrypted);
-            default_color();
+/**
+ * @brief Gives up a job's turn without queuing anything.
+ */
+void skipCommand(struct job *job)
+{
+    stats_add(ignored, 1);
+    device_enqueue(job->ticket, NULL);
+}
 
-            // Take care of the resource
-            sem_wait(sem_mutex);
+/**
+ * @brief Processes a legacy text datagram: the keys or the size letter, ROT128
+ *        encrypted. Nothing is sent back.
+ * @param job The received datagram and its sender.
+ */
+void handleText(struct job *job)
+{
+    struct device_queue *device;
+    struct device_cmd cmd;
+    long retry_ms;
 
-            bold_cyan();
-            printf("[PID : %d] ", getpid());
-            bold_magenta();
-            printf("acquired\n");
-            default_color();
+    if (command_parse(job->data, job->len, &cmd.command) < 0)
+    {
+        log_warn("ignored - no size or keys");
+        skipCommand(job);
+        return;
+    }
+    cmd.addr = job->addr;
+    cmd.received_ns = job->received_ns;
+    cmd.deadline_ns = ttl_ms > 0 ? job->received_ns + ttl_ms * 1000000ULL : 0;
+    cmd.framed = 0;
+
+    log_info_s("decrypted - %s", cmd.command.keys);
+
+    // Without a protocol there is nobody to tell to back off, so a full queue drops it
+    device_turn_begin(job->ticket);
+    device = device_pick(&cmd);
+    retry_ms = device_admit(device, &cmd, 1);
+    if (retry_ms == 0)
+        device_push(device, &cmd);
+    device_turn_end();
+
+    if (retry_ms > 0)
+    {
+        log_warn("rejected - robot queue full, drains in %ld ms", retry_ms);
+        stats_add(rejected, 1);
+        return;
+    }
+    stats_record(STAT_PARSE, job->received_ns, stats_now());
 
-            char *size;
+    log_debug("queued - ticket %ld", (long)job->ticket);
+}
 
-            size = extractLetters(decrypted);
+/**
+ * @brief Processes a binary frame. Its operations are checked before any is queued,
+ *        so a frame is taken whole or not at all, and then queued back to back. A
+ *        retransmission of a frame that was already queued is acknowledged again
+ *        without being queued twice, and a frame its robot has no room for is
+ *        answered with BUSY, or with NACK if it has more operations than a client
+ *        may ever queue.
+ * @param job The received datagram and its sender.
+ * @param header The frame header.
+ * @param payload The frame payload, decrypted in place.
+ */
+void handleFrame(struct job *job, const struct proto_header *header, char *payload)
+{
+    struct device_queue *device = NULL;
+    struct device_cmd cmd;
+    size_t offset = 0;
+    uint8_t opcode;
+    const char *op;
+    size_t op_len;
+    int ops = 0;
+    int result;
+    int duplicate;
+    long retry_ms = 0;
+
+    if (header->opcode == PROTO_PING)
+    {
+        device_enqueue(job->ticket, NULL);
+        sendReply(job, header, PROTO_ACK);
+        return;
+    }
 
-            printf(size);
-            printf("%d\n", strlen(size));
-            printf("%d\n", strcmp(size, "s"));
+    rot128_inplace(payload, header->length);
 
-            if (strcmp(size, "s") == 0 || strcmp(size, "m") == 0 || strcmp(size, "b") == 0)
-            {
-                result = set_size(size);
-            }
-            else
-            {
-                decrypted = extractDigits(decrypted);
-                result = press_keys(decrypted);
-            }
-            if (result < 0)
-            {
-                bold_cyan();
-                printf("[PID : %d] ", getpid());
-                bold_yellow();
-                printf("write ");
-                bold_white();
-                printf("- failed\n");
-                default_color();
-            }
+    while ((result = proto_next_op(header, payload, &offset, &opcode, &op, &op_len)) > 0 &&
+           command_from_op(opcode, op, op_len, &cmd.command) == 0)
+        ops++;
 
-            else
-            {
-                bold_cyan();
-                printf("[PID : %d] ", getpid());
-                bold_yellow();
-                printf("write ");
-                bold_white();
-                printf("- succesfull\n");
-                default_color();
-            }
-
-            bold_cyan();
-            printf("[PID : %d] ", getpid());
-            bold_red();
-            printf("awaiting processing...\n");
-            default_color();
-
-            sleep(5); // Wait 10 segundos
-
-            bold_cyan();
-            printf("[PID : %d] ", getpid());
-            bold_magenta();
-            printf("released\n");
-            default_color();
-
-            sem_post(sem_mutex);
-
-            exit(EXIT_SUCCESS);
-        }
-        else
+    if (result != 0 || ops == 0)
+    {
+        log_warn("ignored - malformed frame, opcode %ld", (long)header->opcode);
+        skipCommand(job);
+        sendReply(job, header, PROTO_NACK);
+        return;
+    }
+    cmd.addr = job->addr;
+    cmd.received_ns = job->received_ns;
+    cmd.framed = 1;
+    cmd.session = header->session;
+    cmd.seq = header->seq;
+    if (header->ttl > 0)
+        cmd.deadline_ns = job->received_ns + header->ttl * PROTO_TTL_UNIT_MS * 1000000ULL;
+    else
+        cmd.deadline_ns = ttl_ms > 0 ? job->received_ns + ttl_ms * 1000000ULL : 0;
+
+    device_turn_begin(job->ticket);
+    duplicate = clients_seen(&job->addr, header->session, header->seq);
+    if (!duplicate)
+    {
+        device = device_pick(&cmd);
+        retry_ms = device_admit(device, &cmd, ops);
+    }
+    if (!duplicate && retry_ms == 0)
+    {
+        for (offset = 0; proto_next_op(header, payload, &offset, &opcode, &op, &op_len) > 0;)
         {
-            // Parent process
-            continue;
+            command_from_op(opcode, op, op_len, &cmd.command);
+            log_info_s("decrypted - %s", cmd.command.keys);
+            device_push(device, &cmd);
         }
+        clients_mark(&job->addr, header->session, header->seq);
+    }
+    device_turn_end();
+
+    if (retry_ms < 0)
+    {
+        log_warn("rejected - %ld operations, more than a client may queue", (long)ops);
+        stats_add(rejected, 1);
+        sendReply(job, header, PROTO_NACK);
+        return;
+    }
+    if (retry_ms > 0)
+    {
+        log_warn("busy - robot queue full, retry after %ld ms", retry_ms);
+        stats_add(rejected, 1);
+        sendBusy(job, header, retry_ms);
+        return;
+    }
+
+    sendReply(job, header, PROTO_ACK);
+
+    if (duplicate)
+    {
+        log_info("duplicate - seq %ld, acknowledged again", (long)header->seq);
+        return;
+    }
+
+    stats_record(STAT_PARSE, job->received_ns, stats_now());
+    log_debug("queued - ticket %ld, %ld operations", (long)job->ticket, (long)ops);
+}
+
+/**
+ * @brief Processes one datagram on a worker thread: decrypts it and queues the keys
+ *        or the size changes for the device, keeping the order datagrams arrived in.
+ * @param job The received datagram and its sender.
+ */
+void handleCommand(struct job *job)
+{
+    struct proto_header header;
+    int offset = proto_decode(job->data, job->len, &header);
+
+    if (offset == PROTO_LEGACY)
+        handleText(job);
+    else if (offset == PROTO_CORRUPT)
+    {
+        log_warn("ignored - damaged or unknown frame");
+        skipCommand(job); // No reply: the client retransmits
     }
+    else
+        handleFrame(job, &header, job->data + offset);
 }
 
 /**
  * @brief Entry point of the UDP server program.
  * @param argc The number of command-line arguments.
  * @param argv An array of strings containing the command-line arguments.
- *             It should have two elements: <port>.
+ *             It should have: [-w workers] [-q ring_depth] [-b batch] [-d devices] [-p affinity|least] [-M step=ms,degree=ms,key=ms,size=ms] [-g margin_ms] [-c coalesce_keys] [-m coalesce_ms] [-a admit_depth] [-W addr[:port]=weight,...] [-t ttl_ms] [-e uring|epoll] <port>.
  * @return 0 on success, 1 on incorrect command-line arguments.
  */
 int main(int argc, char *argv[])
 {
+    int opt;
+    int workers = POOL_WORKERS;
+    int queue_depth = POOL_QUEUE_DEPTH;
+    struct model model = model_default();
+    int margin_ms = DEVICE_MARGIN_MS;
+    int coalesce_keys = DEVICE_COALESCE_KEYS;
+    int coalesce_ms = DEVICE_COALESCE_MS;
+    int admit_depth = DEVICE_ADMIT_DEPTH;
+    int batch = RECV_BATCH;
+    const char *device = KP_DEFAULT_DEVICE;
+    enum device_route route = ROUTE_AFFINITY;
+    int use_uring = 1;
+
+    // Parse options
+    while ((opt = getopt(argc, argv, "w:q:b:d:p:M:g:c:m:a:W:t:e:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'q':
+            queue_depth = atoi(optarg);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'd':
+            device = optarg;
+            break;
+        case 'p':
+            if (strcmp(optarg, "affinity") == 0)
+                route = ROUTE_AFFINITY;
+            else if (strcmp(optarg, "least") == 0)
+                route = ROUTE_LEAST;
+            else
+                workers = 0;
+            break;
+        case 'M':
+            if (model_parse(&model, optarg) < 0)
+                workers = 0;
+            break;
+        case 'g':
+            margin_ms = atoi(optarg);
+            break;
+        case 'c':
+            coalesce_keys = atoi(optarg);
+            break;
+        case 'm':
+            coalesce_ms = atoi(optarg);
+            break;
+        case 'a':
+            admit_depth = atoi(optarg);
+            break;
+        case 'W':
+            if (device_set_weights(optarg) < 0)
+                workers = 0;
+            break;
+        case 't':
+            ttl_ms = atol(optarg);
+            break;
+        case 'e':
+            if (strcmp(optarg, "uring") == 0)
+                use_uring = 1;
+            else if (strcmp(optarg, "epoll") == 0)
+                use_uring = 0;
+            else
+                workers = 0;
+            break;
+        default:
+            workers = 0;
+            break;
+        }
+    }
+
     // Validate arguments
-    if (argc != 2)
+    if (argc - optind != 1 || workers <= 0 || queue_depth <= 0 || batch <= 0 || margin_ms < 0 ||
+        coalesce_keys <= 0 || coalesce_keys > COMMAND_MAX_KEYS || coalesce_ms < 0 ||
+        admit_depth <= 0 || admit_depth > DEVICE_QUEUE_DEPTH || ttl_ms < 0)
     {
         bold_yellow();
-        printf("⭐ Usage: %s <port>\n", argv[0]);
+        printf("⭐ Usage: %s [-w workers] [-q ring_depth] [-b batch] [-d devices] [-p affinity|least] [-M step=ms,degree=ms,key=ms,size=ms] [-g margin_ms] [-c coalesce_keys] [-m coalesce_ms] [-a admit_depth] [-W addr[:port]=weight,...] [-t ttl_ms] [-e uring|epoll] <port>\n", argv[0]);
         default_color();
         return 1;
     }
 
-    // Create semaphore
-    create_semaphore();
+    // Start the logger before any thread that logs
+    if (log_start() < 0)
+    {
+        bold_red();
+        printf("\n⛔ Couldn't start the logger.\n");
+        default_color();
+        exit(EXIT_FAILURE);
+    }
+
+    // Publish statistics for kpstat
+    if (stats_start() < 0)
+    {
+        bold_yellow();
+        printf("⭐ Statistics segment unavailable, kpstat will not see this server.\n");
+        default_color();
+    }
+
+    // Start the device consumer
+    device_set_expired(sendExpired);
+    if (device_start(device, route, &model, margin_ms, coalesce_keys, coalesce_ms, admit_depth) < 0)
+    {
+        bold_red();
+        printf("\n⛔ Couldn't start the device queues (no device matches %s).\n", device);
+        default_color();
+        exit(EXIT_FAILURE);
+    }
 
     // Handle termination
     signal(SIGINT, handle_shut_down);  // Set up a signal handler for Ctrl+C
     signal(SIGTSTP, handle_shut_down); // Set up a signal handler for Ctrl+Z
+    signal(SIGTERM, handle_shut_down); // Set up a signal handler for kill
+
+    // Start the workers
+    if (pool_start(workers, queue_depth, handleCommand) < 0)
+    {
+        bold_red();
+        printf("\n⛔ Couldn't start the worker pool.\n");
+        default_color();
+        exit(EXIT_FAILURE);
+    }
 
     // Create server and handle messages
-    createServer(atoi(argv[1]));
-    handleMessage();
+    createServer(atoi(argv[optind]));
+    if (recv_start(sockfd, batch) < 0)
+    {
+        bold_red();
+        printf("\n⛔ Couldn't set up the receive engine.\n");
+        default_color();
+        exit(EXIT_FAILURE);
+    }
+
+    // io_uring when the kernel allows it, otherwise the epoll loop
+    if (use_uring && uring_start(batch) < 0)
+    {
+        bold_yellow();
+        printf("⭐ io_uring unavailable, receiving with epoll.\n");
+        default_color();
+        use_uring = 0;
+    }
+    if (use_uring && uring_loop(sockfd) < 0)
+    {
+        bold_yellow();
+        printf("⭐ io_uring can't receive multishot, receiving with epoll.\n");
+        default_color();
+    }
+    recv_loop(sockfd);
 
     // Close socket
     close(sockfd);
 
-    // Destroy semaphore
-    sem_close(sem_mutex);
-    sem_unlink(sem_mutex_name);
-
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,261 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* *********************************
+    Statistics segment
+************************************ */
+
+#define STATS_NAME "/kp_stats"     // Shared memory object read by kpstat
+#define STATS_MAGIC 0x4b505354     // "KPST"
+#define STATS_VERSION 5
+#define STATS_SUB_BITS 5           // 32 sub-buckets per power of two, about 3% precision
+#define STATS_SUB_COUNT (1 << STATS_SUB_BITS)
+#define STATS_MAX_SHIFT 34         // Largest recorded value is about 2^40 us
+#define STATS_BUCKETS ((STATS_MAX_SHIFT + 2) * STATS_SUB_COUNT)
+#define STATS_CLIENTS 64           // Clients with their own counters; later ones share the last slot
+
+/**
+ * Stages of a command's life, each with its own latency histogram.
+ */
+enum stats_stage
+{
+    STAT_PARSE,  // Datagram received -> command queued for the device
+    STAT_WAIT,   // Datagram received -> taken by the device consumer
+    STAT_WRITE,  // Serial write start -> serial write end
+    STAT_DEVICE, // Serial write end -> device ready for the next command
+    STAT_TOTAL,  // Datagram received -> serial write end
+    STAT_STAGES
+};
+
+/**
+ * Log-linear histogram of latencies in microseconds, in the style of HdrHistogram:
+ * values below STATS_SUB_COUNT have their own bucket, larger ones keep their top
+ * STATS_SUB_BITS + 1 significant bits.
+ */
+struct stats_histogram
+{
+    uint64_t count;                  // Samples recorded
+    uint64_t sum;                    // Sum of the samples
+    uint64_t max;                    // Largest sample
+    uint64_t buckets[STATS_BUCKETS]; // Samples per bucket
+};
+
+/**
+ * Counters of one client.
+ */
+struct stats_client
+{
+    uint64_t key;         // Address and port of the client, 0 while the slot is free
+    uint32_t weight;      // Fair queueing weight
+    uint32_t robot;       // Robot that served the client last
+    uint64_t queued;      // Commands waiting for the robot
+    uint64_t served;      // Commands written to the robot
+    uint64_t wait_us;     // Sum of the times from arrival to the robot taking the command
+    uint64_t service_us;  // Sum of the times the robot spent on the client's commands
+};
+
+/**
+ * Everything the server publishes. Only the server writes, with relaxed atomics, so
+ * readers never block it and may see a slightly inconsistent snapshot.
+ */
+struct stats_segment
+{
+    uint32_t magic;          // STATS_MAGIC once the segment is ready
+    uint32_t version;        // STATS_VERSION
+    uint64_t started;        // Server start time, seconds since the epoch
+    uint64_t received;       // Datagrams received
+    uint64_t ignored;        // Datagrams with no command in them
+    uint64_t rejected;       // Datagrams refused because their robot's queue was full
+    uint64_t expired;        // Commands dropped because their deadline passed
+    uint64_t executed;       // Commands written to the device
+    uint64_t write_errors;   // Commands the device could not take
+    uint64_t kernel_drops;   // Datagrams dropped by the kernel (SO_RXQ_OVFL)
+    uint64_t truncated;      // Datagrams dropped for being longer than a job slot
+    uint64_t jobs_queued;    // Datagrams waiting for a worker
+    uint64_t device_queued;  // Commands waiting for the device
+    struct stats_histogram histograms[STAT_STAGES];
+    struct stats_client clients[STATS_CLIENTS];
+};
+
+static struct stats_segment *stats;           // Mapped segment, or a private fallback
+static struct stats_segment stats_fallback;   // Used when shared memory is unavailable
+
+/**
+ * @brief Returns the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static inline uint64_t stats_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Returns the histogram bucket of a value.
+ */
+static inline int stats_bucket(uint64_t value)
+{
+    int shift;
+
+    if (value < STATS_SUB_COUNT)
+        return (int)value;
+
+    shift = 63 - __builtin_clzll(value) - STATS_SUB_BITS;
+    if (shift > STATS_MAX_SHIFT)
+        return STATS_BUCKETS - 1;
+    return (shift + 1) * STATS_SUB_COUNT + (int)((value >> shift) - STATS_SUB_COUNT);
+}
+
+/**
+ * @brief Returns the smallest value that falls in a bucket.
+ */
+static inline uint64_t stats_bucket_value(int bucket)
+{
+    int shift;
+
+    if (bucket < STATS_SUB_COUNT)
+        return bucket;
+
+    shift = bucket / STATS_SUB_COUNT - 1;
+    return (uint64_t)(bucket % STATS_SUB_COUNT + STATS_SUB_COUNT) << shift;
+}
+
+/**
+ * @brief Records the time between two stage timestamps.
+ * @param stage The histogram to update.
+ * @param from_ns The start of the interval, from stats_now().
+ * @param to_ns The end of the interval, from stats_now().
+ */
+static inline void stats_record(enum stats_stage stage, uint64_t from_ns, uint64_t to_ns)
+{
+    struct stats_histogram *histogram = &stats->histograms[stage];
+    uint64_t us = to_ns > from_ns ? (to_ns - from_ns) / 1000 : 0;
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&histogram->buckets[stats_bucket(us)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    while (us > max && !__atomic_compare_exchange_n(&histogram->max, &max, us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * @brief Adds to a counter of the segment.
+ */
+#define stats_add(field, n) __atomic_fetch_add(&stats->field, (n), __ATOMIC_RELAXED)
+
+/**
+ * @brief Sets a gauge of the segment.
+ */
+#define stats_set(field, v) __atomic_store_n(&stats->field, (v), __ATOMIC_RELAXED)
+
+/**
+ * @brief Returns the key of a client in the client table.
+ */
+static inline uint64_t stats_client_key(uint32_t addr, uint16_t port)
+{
+    return 1ULL << 48 | (uint64_t)addr << 16 | port;
+}
+
+/**
+ * @brief Finds the counters of a client, claiming a free slot for a new one.
+ * @param addr The client IPv4 address, in network byte order.
+ * @param port The client port, in network byte order.
+ * @return The counters. Once the table is full, new clients share the last slot.
+ */
+struct stats_client *stats_client(uint32_t addr, uint16_t port)
+{
+    uint64_t key = stats_client_key(addr, port);
+    uint64_t found;
+    uint32_t slot = (addr * 2654435761u ^ port * 40503u) % (STATS_CLIENTS - 1);
+
+    for (int i = 0; i < STATS_CLIENTS - 1; i++)
+    {
+        struct stats_client *client = &stats->clients[(slot + i) % (STATS_CLIENTS - 1)];
+
+        found = __atomic_load_n(&client->key, __ATOMIC_ACQUIRE);
+        if (found == 0 && __atomic_compare_exchange_n(&client->key, &found, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return client;
+        if (found == key)
+            return client;
+    }
+
+    __atomic_store_n(&stats->clients[STATS_CLIENTS - 1].key, ~0ULL, __ATOMIC_RELAXED);
+    return &stats->clients[STATS_CLIENTS - 1];
+}
+
+/**
+ * @brief Adds to a counter of a client.
+ */
+#define stats_client_add(client, field, n) __atomic_fetch_add(&(client)->field, (n), __ATOMIC_RELAXED)
+
+/**
+ * @brief Returns the value below which a fraction of the samples fall.
+ * @param histogram The histogram to read.
+ * @param quantile The fraction, between 0 and 1.
+ */
+uint64_t stats_percentile(const struct stats_histogram *histogram, double quantile)
+{
+    uint64_t target = (uint64_t)(histogram->count * quantile + 0.5);
+    uint64_t seen = 0;
+
+    if (target == 0)
+        target = 1;
+
+    for (int i = 0; i < STATS_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= target)
+            return stats_bucket_value(i);
+    }
+    return histogram->max;
+}
+
+/**
+ * @brief Creates the shared statistics segment. If shared memory is unavailable the
+ *        server keeps its statistics in private memory instead.
+ * @return 0 if the segment is shared, -1 if the fallback is used.
+ */
+int stats_start()
+{
+    int fd;
+    void *segment;
+
+    stats = &stats_fallback;
+
+    fd = shm_open(STATS_NAME, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0)
+        return -1;
+
+    if (ftruncate(fd, sizeof(struct stats_segment)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    segment = mmap(NULL, sizeof(struct stats_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED)
+        return -1;
+
+    stats = (struct stats_segment *)segment;
+    memset(stats, 0, sizeof(struct stats_segment));
+    stats->version = STATS_VERSION;
+    stats->started = time(NULL);
+    __atomic_store_n(&stats->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief Removes the shared statistics segment.
+ */
+void stats_stop()
+{
+    shm_unlink(STATS_NAME);
+}
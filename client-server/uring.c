@@ -0,0 +1,325 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+/* *********************************
+    io_uring receive engine
+************************************ */
+
+#define URING_BUFFERS 256   // Receive buffers lent to the kernel; a power of two
+#define URING_GROUP 0       // Buffer group of the receive buffers
+#define URING_RECV 1        // user_data of the multishot receive
+#define URING_BUFFER_SIZE (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + \
+                           RECV_CONTROL_SIZE + JOB_DATA_SIZE)
+
+/**
+ * The rings shared with the kernel, mapped from the io_uring file descriptor.
+ */
+struct uring
+{
+    int fd;                       // io_uring instance, -1 when closed
+    void *ring;                   // Mapped submission and completion rings
+    size_t ring_size;
+    unsigned *sq_head;            // Submission queue indexes and entries
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;    // Mapped submission entries
+    size_t sqes_size;
+    unsigned *cq_head;            // Completion queue indexes and entries
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring; // Receive buffers handed to the kernel
+    char *buffers;                // URING_BUFFERS buffers of URING_BUFFER_SIZE bytes
+    unsigned short buf_tail;      // Next free entry of the buffer ring
+    struct msghdr msg;            // Layout of what the multishot receive writes into a buffer
+};
+
+static struct uring uring = {.fd = -1};
+static int uring_batch;          // Most datagrams published to the workers at once
+
+/**
+ * @brief Maps a region of the io_uring instance.
+ */
+static void *uring_map(size_t size, off_t offset)
+{
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, offset);
+
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+/**
+ * @brief Gives a receive buffer back to the kernel. It is seen once the buffer ring's
+ *        tail is published by uring_publish_buffers().
+ */
+static inline void uring_return_buffer(unsigned short bid)
+{
+    struct io_uring_buf *buf = &uring.buf_ring->bufs[uring.buf_tail & (URING_BUFFERS - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(uring.buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    uring.buf_tail++;
+}
+
+/**
+ * @brief Publishes the buffers given back since the last call.
+ */
+static inline void uring_publish_buffers()
+{
+    __atomic_store_n(&uring.buf_ring->tail, uring.buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Queues the multishot receive on the socket. It keeps producing a completion
+ *        per datagram until the kernel runs out of buffers.
+ * @return The number of entries queued, for io_uring_enter().
+ */
+static int uring_arm(int fd)
+{
+    unsigned tail = *uring.sq_tail;
+    unsigned index = tail & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)&uring.msg;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GROUP;
+    sqe->user_data = URING_RECV;
+
+    uring.sq_array[index] = index;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * @brief Closes the io_uring instance and releases its rings and buffers.
+ */
+static void uring_stop()
+{
+    if (uring.ring != NULL)
+        munmap(uring.ring, uring.ring_size);
+    if (uring.sqes != NULL)
+        munmap(uring.sqes, uring.sqes_size);
+    if (uring.buf_ring != NULL)
+        munmap(uring.buf_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+    free(uring.buffers);
+    if (uring.fd >= 0)
+        close(uring.fd);
+
+    memset(&uring, 0, sizeof(uring));
+    uring.fd = -1;
+}
+
+/**
+ * @brief Prepares an io_uring instance for receiving: maps its rings and lends the
+ *        kernel URING_BUFFERS buffers to receive into. uring_loop() gives it the socket.
+ * @param batch The most datagrams published to the workers at once.
+ * @return 0 on success, -1 if the kernel has no usable io_uring.
+ */
+int uring_start(int batch)
+{
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    size_t sq_size, cq_size;
+    char *sq, *cq;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_BUFFERS * 2; // Room for a completion per buffer, with slack
+    uring.fd = syscall(__NR_io_uring_setup, 4, &params);
+    if (uring.fd < 0)
+    {
+        uring.fd = -1;
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        uring_stop();
+        return -1;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring.ring_size = sq_size > cq_size ? sq_size : cq_size;
+    uring.ring = sq = cq = uring_map(uring.ring_size, IORING_OFF_SQ_RING);
+    uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring.sqes = uring_map(uring.sqes_size, IORING_OFF_SQES);
+    if (sq == NULL || uring.sqes == NULL)
+    {
+        uring_stop();
+        return -1;
+    }
+
+    uring.sq_head = (unsigned *)(sq + params.sq_off.head);
+    uring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + params.sq_off.array);
+    uring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // The buffer ring must be page aligned
+    uring.buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring.buf_ring == MAP_FAILED)
+        uring.buf_ring = NULL;
+    uring.buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    if (uring.buf_ring == NULL || uring.buffers == NULL)
+    {
+        uring_stop();
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)uring.buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_GROUP;
+    if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        uring_stop();
+        return -1;
+    }
+
+    for (int i = 0; i < URING_BUFFERS; i++)
+        uring_return_buffer(i);
+    uring_publish_buffers();
+
+    // Each buffer receives the header, the sender address, the ancillary data and the payload
+    memset(&uring.msg, 0, sizeof(uring.msg));
+    uring.msg.msg_namelen = sizeof(struct sockaddr_in);
+    uring.msg.msg_controllen = RECV_CONTROL_SIZE;
+
+    uring_batch = batch;
+    return 0;
+}
+
+/**
+ * @brief Copies the datagram a completion describes into a job slot.
+ * @return 0 on success, -1 if the buffer doesn't hold a datagram or it was longer than
+ *         a slot.
+ */
+static int uring_fill(const struct io_uring_cqe *cqe, struct job *slot, uint64_t now)
+{
+    char *buf = uring.buffers + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUFFER_SIZE;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+    char *control = buf + sizeof(*out) + uring.msg.msg_namelen;
+    char *payload = control + uring.msg.msg_controllen;
+    struct msghdr msg;
+
+    if ((size_t)cqe->res < sizeof(*out) + uring.msg.msg_namelen + uring.msg.msg_controllen)
+        return -1;
+
+    if (out->controllen > 0)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = out->controllen;
+        recv_update_drops(&msg);
+    }
+
+    if (out->flags & MSG_TRUNC)
+    {
+        stats_add(truncated, 1);
+        return -1;
+    }
+
+    memcpy(&slot->addr, buf + sizeof(*out), sizeof(slot->addr));
+    slot->len = out->payloadlen;
+    memcpy(slot->data, payload, slot->len);
+    slot->data[slot->len] = '\0';
+    slot->received_ns = now;
+    return 0;
+}
+
+/**
+ * @brief Receive loop on io_uring: one io_uring_enter() waits for any number of
+ *        datagrams, which are copied into the job queue a batch at a time.
+ * @param fd The UDP socket prepared by recv_start().
+ * @return -1 if the kernel can't do multishot receives (before 6.0); the instance is
+ *         closed then and recv_loop() should take over. Otherwise it doesn't return.
+ */
+int uring_loop(int fd)
+{
+    struct io_uring_cqe *cqe;
+    struct job *slots = NULL;
+    unsigned head, tail;
+    uint64_t now;
+    int to_submit = uring_arm(fd);
+    int reserved = 0;
+    int filled = 0;
+    int working = 0; // Whether the multishot receive has worked at least once
+
+    while (1)
+    {
+        if (syscall(__NR_io_uring_enter, uring.fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            bold_red();
+            printf("\n⛔ Couldn't wait for messages.\n");
+            exit(EXIT_FAILURE);
+        }
+        to_submit = 0;
+
+        head = *uring.cq_head;
+        tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+        now = stats_now();
+
+        for (; head != tail; head++)
+        {
+            cqe = &uring.cqes[head & *uring.cq_mask];
+
+            // Kernels without multishot receives reject the first one
+            if (cqe->res < 0 && cqe->res != -ENOBUFS && !working)
+            {
+                uring_stop();
+                return -1;
+            }
+            if (cqe->res < 0 && cqe->res != -ENOBUFS)
+            {
+                bold_red();
+                printf("\n⛔ Couldn't receive.\n");
+                exit(EXIT_FAILURE);
+            }
+
+            working = 1;
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+            {
+                if (filled == reserved)
+                {
+                    pool_commit(filled);
+                    stats_add(received, filled);
+                    reserved = pool_reserve(&slots, (int)(tail - head) < uring_batch ? (int)(tail - head) : uring_batch);
+                    filled = 0;
+                }
+                if (uring_fill(cqe, &slots[filled], now) == 0)
+                    filled++;
+                uring_return_buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+
+            // The kernel stops a multishot receive when it runs out of buffers
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                to_submit += uring_arm(fd);
+        }
+
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+        uring_publish_buffers();
+        pool_commit(filled);
+        stats_add(received, filled);
+        reserved = filled = 0;
+    }
+}
@@ -1,43 +1,100 @@
 #include <stdlib.h> // for dynamic memory allocation
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define SEPARATOR ' '
 
 /**
- * @brief Performs ROT128 encryption on the given message.
- *
- * @param message The message to be encrypted.
- * @return The encrypted message as a dynamically allocated string.
- *         If memory allocation fails or the input parameter is invalid (NULL), returns NULL.
- *         It is the responsibility of the caller to free the memory.
+ * @brief ROT128 over a buffer with plain C: rotating a byte by 128 only flips its top
+ *        bit, so whole words can be XORed with 0x80 in every byte at once.
  */
-char *rot128(const char *message)
+static void rot128_scalar(unsigned char *buf, size_t len)
 {
-    if (message == NULL)
+    size_t i = 0;
+    uint64_t word;
+
+    for (; i + sizeof(word) <= len; i += sizeof(word))
     {
-        bold_red();
-        printf("\n⛔  Invalid message.\n");
-        exit(EXIT_FAILURE);
+        memcpy(&word, buf + i, sizeof(word));
+        word ^= 0x8080808080808080ULL;
+        memcpy(buf + i, &word, sizeof(word));
     }
+    for (; i < len; i++)
+        buf[i] ^= 0x80;
+}
 
-    size_t messageLen = strlen(message);
-    char *encrypted = (char *)malloc(messageLen + 1); // +1 for null terminator
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @brief ROT128 over a buffer, 16 bytes per instruction.
+ */
+__attribute__((target("sse2"))) static void rot128_sse2(unsigned char *buf, size_t len)
+{
+    const __m128i mask = _mm_set1_epi8((char)0x80);
+    size_t i = 0;
 
-    if (encrypted == NULL)
+    for (; i + 16 <= len; i += 16)
     {
-        bold_red();
-        printf("\n⛔  Memory allocation failed.\n");
-        exit(EXIT_FAILURE);
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        _mm_storeu_si128((__m128i *)(buf + i), _mm_xor_si128(v, mask));
     }
+    rot128_scalar(buf + i, len - i);
+}
+
+/**
+ * @brief ROT128 over a buffer, 32 bytes per instruction.
+ */
+__attribute__((target("avx2"))) static void rot128_avx2(unsigned char *buf, size_t len)
+{
+    const __m256i mask = _mm256_set1_epi8((char)0x80);
+    size_t i = 0;
 
-    for (size_t i = 0; i < messageLen; ++i)
+    for (; i + 32 <= len; i += 32)
     {
-        encrypted[i] = (message[i] + 128) % 256;
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        _mm256_storeu_si256((__m256i *)(buf + i), _mm256_xor_si256(v, mask));
     }
-    encrypted[messageLen] = '\0'; // Null-terminate the encrypted message
+    rot128_sse2(buf + i, len - i);
+}
+#endif
 
-    return encrypted;
+/**
+ * @brief Picks the widest ROT128 kernel the CPU supports.
+ */
+static void (*rot128_select())(unsigned char *, size_t)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return rot128_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return rot128_sse2;
+#endif
+    return rot128_scalar;
+}
+
+/**
+ * @brief Performs ROT128 encryption in place. ROT128 is its own inverse, so the same
+ *        call decrypts. The length is explicit, so the buffer may contain 0x80 bytes
+ *        (an encrypted NUL) and does not need to be null-terminated.
+ *
+ * @param buf The message to be encrypted or decrypted.
+ * @param len The number of bytes in the message.
+ */
+void rot128_inplace(char *buf, size_t len)
+{
+    static void (*kernel)(unsigned char *, size_t);
+    void (*selected)(unsigned char *, size_t) = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+
+    if (selected == NULL)
+    {
+        selected = rot128_select();
+        __atomic_store_n(&kernel, selected, __ATOMIC_RELAXED);
+    }
+    selected((unsigned char *)buf, len);
 }
 
 char *addSpaces(const char *input)
@@ -65,7 +122,7 @@ char *addSpaces(const char *input)
     }
 
     // Add the null character at the end of the output string
-    // output[j] = '\0';
+    output[j] = '\0';
 
     return output;
 }
\ No newline at end of file
@@ -1,113 +1,1232 @@
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <pthread.h>
+#include <glob.h>
+#include <sys/eventfd.h>
+
+#include "my_lib.h"
+
+#define KP_BAUD_RATE B9600    // Must match Serial.begin() in the sketch
+#define KP_BOOT_DELAY_MS 2000 // Time the Arduino bootloader needs after a reset
+#define KP_PENDING_MAX 64     // Commands tracked at once until the robot reports them done
+#define KP_LINE_MAX 128       // Longest line read back from the sketch
+#define KP_SUBMIT_MAX 64      // Submitted commands a handle holds until their completions are collected
+
+static const char press_prefix[] = "d "; // Clears the display before the keys
+static const char press_suffix[] = "r "; // Confirms the keys once they are typed
+static const char size_suffix[] = "\n "; // Terminates a size token as the sketch expects
+static const char size_sentinel[] = "? "; // Unknown key: the sketch reports it once the size change is over
+static const char calibrate_prefix[] = "k"; // Starts a calibration token
+static const char token_suffix[] = " ";     // Ends a token
+
+/**
+ * A command written to the robot that it has not reported finished yet.
+ */
+struct kp_pending
+{
+    int tokens;   // Tokens the sketch still has to finish
+    int async;    // Whether it was submitted with kp_submit(), so it gets a completion
+    int rejected; // Whether the sketch rejected one of its tokens
+    void *cookie; // The submitter's cookie
+    unsigned long id; // Tells the command apart while others are added and finished
+};
+
+/**
+ * A command submitted with kp_submit() and not written to the robot yet.
+ */
+struct kp_submission
+{
+    enum kp_command_type type;  // What the command does
+    char text[KP_COMMAND_MAX];  // Its size or keys
+    void *cookie;               // The submitter's cookie
+};
+
+/**
+ * An open serial connection to the keyboard robot.
+ */
+struct kp_handle
+{
+    int fd;                           // Serial port file descriptor
+    int event_fd;                     // eventfd counting the completions waiting to be collected
+    int wake_fd;                      // eventfd that wakes the I/O thread
+    pthread_t reader;                 // Thread reading what the sketch prints and writing submissions
+    int reading;                      // Whether the I/O thread runs
+    pthread_mutex_t write_lock;       // Serializes commands on the port, so they reach it in the order they are expected
+    pthread_mutex_t lock;             // Guards the fields below
+    pthread_cond_t done;              // Signaled when a command finishes or the port fails
+    int stopping;                     // Whether the I/O thread has to stop
+    struct kp_pending pending[KP_PENDING_MAX]; // Commands the robot is working on, oldest first
+    int pending_head;                 // Index of the oldest command
+    int pending_count;                // Number of commands not finished yet
+    unsigned long pending_id;         // id of the last command added
+    struct kp_submission submitted[KP_SUBMIT_MAX]; // Submissions waiting for the robot, oldest first
+    int submitted_head;               // Index of the oldest submission
+    int submitted_count;              // Number of submissions waiting
+    struct kp_completion completions[KP_SUBMIT_MAX]; // Completions not collected yet, oldest first
+    int completions_head;             // Index of the oldest completion
+    int completions_count;            // Number of completions waiting
+    int outstanding;                  // Submissions whose completion was not collected yet
+    int in_token;                     // Whether the sketch is working on a token
+    unsigned long resets;             // Times the sketch restarted
+    int rejected;                     // Whether the sketch rejected a command sent since the last kp_wait_idle()
+    int failed;                       // Whether reading the port failed
+    char line[KP_LINE_MAX];           // Line being read
+    size_t line_len;                  // Length of the line being read
+};
+
+/**
+ * A set of robots, each behind its own serial port.
+ */
+struct kp_pool
+{
+    int count;           // Number of devices
+    char **paths;        // Serial device of each robot
+    kp_handle **handles; // Open handle of each robot, NULL while it is unavailable
+};
+
+static kp_handle *default_handle;                                 // Handle used by set_size() and press_keys()
+static pthread_mutex_t default_handle_lock = PTHREAD_MUTEX_INITIALIZER; // Guards default_handle
 
 /**
- * The function attempts to open a file descriptor for a USB device and returns 0 if successful, 1
- * otherwise.
+ * The function puts the serial port in raw mode at the sketch's baud rate and clears HUPCL so that
+ * closing the port does not drop DTR, which would reset the Arduino the next time it is opened.
  *
- * @return The function `open_usb_fd()` returns an integer value. If the file descriptor `fd` is
- * successfully opened, the function returns 0. If there is an error opening the file descriptor, the
- * function returns -1.
+ * @param fd The serial port file descriptor.
+ *
+ * @return 0 on success, -1 if the port could not be configured.
  */
-static int open_usb_fd()
+static int configure_usb_fd(int fd)
 {
-    int fd;
-    fd = open("/dev/ttyUSB0", O_RDWR);
-    if (fd == -1)
+    struct termios tty;
+
+    if (tcgetattr(fd, &tty) == -1)
+    {
+        return -1;
+    }
+
+    cfmakeraw(&tty);
+    cfsetispeed(&tty, KP_BAUD_RATE);
+    cfsetospeed(&tty, KP_BAUD_RATE);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cflag &= ~HUPCL;
+    tty.c_cc[VMIN] = 0;
+    tty.c_cc[VTIME] = 0;
+
+    return tcsetattr(fd, TCSANOW, &tty);
+}
+
+/**
+ * The function opens and configures the serial port of the robot without waiting for the Arduino to
+ * boot.
+ *
+ * @param path The serial device.
+ *
+ * @return A new handle, or NULL if the device could not be opened.
+ */
+static kp_handle *open_handle(const char *path)
+{
+    kp_handle *handle;
+
+    handle = (kp_handle *)calloc(1, sizeof(kp_handle));
+    if (handle == NULL)
+    {
+        return NULL;
+    }
+    handle->event_fd = -1;
+    handle->wake_fd = -1;
+    pthread_mutex_init(&handle->write_lock, NULL);
+    pthread_mutex_init(&handle->lock, NULL);
+
+    handle->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (handle->fd == -1)
     {
         perror("Error: Opening the driver file descriptor failed\n");
-        close(fd);
-        return fd;
+        free(handle);
+        return NULL;
+    }
+
+    if (configure_usb_fd(handle->fd) == -1)
+    {
+        perror("Error: Configuring the serial port failed\n");
+        close(handle->fd);
+        free(handle);
+        return NULL;
     }
-    return fd;
+
+    return handle;
 }
 
 /**
- * The function writes data to a USB driver file and returns an error if the write operation fails.
+ * The function reports a submitted command as over, for kp_poll_completions() to collect, and makes the
+ * event file descriptor readable.
  *
- * @param data A pointer to the data that needs to be written to the USB device.
- * @param data_len The length of the data to be written to the USB device.
+ * @param handle The handle, with its lock held.
+ * @param cookie The submitter's cookie.
+ * @param status 0 if the robot finished the command, otherwise a negative errno value.
+ */
+static void complete(kp_handle *handle, void *cookie, int status)
+{
+    struct kp_completion *completion;
+    uint64_t one = 1;
+
+    completion = &handle->completions[(handle->completions_head + handle->completions_count) % KP_SUBMIT_MAX];
+    completion->cookie = cookie;
+    completion->status = status;
+    handle->completions_count++;
+
+    if (write(handle->event_fd, &one, sizeof(one)) == -1)
+    {
+        perror("Error: Signaling a completion failed\n");
+    }
+}
+
+/**
+ * The function drops every command the robot is working on, completing the submitted ones with an
+ * error.
  *
- * @return an integer value, either 0 or -1.
+ * @param handle The handle, with its lock held.
+ * @param status The negative errno value to complete them with.
  */
-static int write_to_usb(char *data, int data_len)
+static void drop_pending(kp_handle *handle, int status)
 {
-    int fd = open_usb_fd();
-    ssize_t num_written;
-    num_written = write(fd, data, data_len - 1);
-    if (num_written == -1)
+    struct kp_pending *pending;
+
+    while (handle->pending_count > 0)
     {
-        perror("Error: Writting to the driver file failed\n");
-        close(fd);
-        return num_written;
+        pending = &handle->pending[handle->pending_head];
+        if (pending->async)
+        {
+            complete(handle, pending->cookie, status);
+        }
+        handle->pending_head = (handle->pending_head + 1) % KP_PENDING_MAX;
+        handle->pending_count--;
     }
-    printf("\033[1;37m  ⭐ data sent  \033[0m");
-    printf("\033[0;30m%s\033[0m\n", data);
+    pthread_cond_broadcast(&handle->done);
+}
+
+/**
+ * The function marks the robot as done with one token of the oldest command. Once the command has no
+ * tokens left it is finished, and its submitter and any kp_wait_idle() are told.
+ *
+ * @param handle The handle, with its lock held.
+ * @param rejected Whether the sketch rejected the token instead of carrying it out.
+ */
+static void finish_token(kp_handle *handle, int rejected)
+{
+    struct kp_pending *pending;
+
+    if (handle->pending_count == 0)
+    {
+        return;
+    }
+
+    pending = &handle->pending[handle->pending_head];
+    pending->rejected |= rejected;
+    if (--pending->tokens > 0)
+    {
+        return;
+    }
+
+    if (pending->async)
+    {
+        complete(handle, pending->cookie, pending->rejected ? -EINVAL : 0);
+    }
+    else if (pending->rejected)
+    {
+        handle->rejected = 1;
+    }
+    handle->pending_head = (handle->pending_head + 1) % KP_PENDING_MAX;
+    handle->pending_count--;
+    pthread_cond_broadcast(&handle->done);
+}
+
+/**
+ * The function interprets one line printed by the sketch. Every key token the sketch reads starts with
+ * "Number to be pressed" and ends either with the last row of the keypad dump, which begins with the
+ * delete key, or with "Target number not found". A calibration token is answered with a single line
+ * starting with "Calibrat", which is "Calibration rejected" if the sketch refused it. "STARTED" means the Arduino was reset, so whatever it was doing is lost.
+ *
+ * @param handle The handle, with its lock held.
+ * @param line The line, without its line ending.
+ */
+static void parse_line(kp_handle *handle, const char *line)
+{
+    if (strncmp(line, "Number to be pressed", 20) == 0)
+    {
+        handle->in_token = 1;
+    }
+    else if (handle->in_token && (strncmp(line, "d,", 2) == 0 || strncmp(line, "d*,", 3) == 0 ||
+                                  strncmp(line, "Target number not found", 23) == 0))
+    {
+        handle->in_token = 0;
+        finish_token(handle, 0);
+    }
+    else if (strncmp(line, "Calibrat", 8) == 0)
+    {
+        finish_token(handle, strncmp(line, "Calibration rejected", 20) == 0);
+    }
+    else if (strstr(line, "STARTED") != NULL)
+    {
+        handle->in_token = 0;
+        handle->resets++;
+        drop_pending(handle, -ECONNRESET);
+    }
+}
+
+static int send_command(kp_handle *handle, enum kp_command_type type, const char *text, int async,
+                        void *cookie);
+
+/**
+ * The function writes the oldest submission to the robot once it is done with everything before it.
+ * The sketch reads from a small serial buffer, so the robot is given one command at a time.
+ *
+ * @param handle The handle, with its lock held. The lock is released while writing.
+ */
+static void send_submission(kp_handle *handle)
+{
+    struct kp_submission submission;
+    int result;
+
+    if (handle->pending_count > 0 || handle->submitted_count == 0)
+    {
+        return;
+    }
+
+    // Only this thread takes submissions, so the oldest one stays put while the lock is released. It
+    // leaves the queue once it is pending, so the handle never looks idle in between.
+    submission = handle->submitted[handle->submitted_head];
+    pthread_mutex_unlock(&handle->lock);
+    result = send_command(handle, submission.type, submission.text, 1, submission.cookie);
+    pthread_mutex_lock(&handle->lock);
+
+    handle->submitted_head = (handle->submitted_head + 1) % KP_SUBMIT_MAX;
+    handle->submitted_count--;
+    if (result == -1)
+    {
+        complete(handle, submission.cookie, -EIO);
+        pthread_cond_broadcast(&handle->done);
+    }
+}
+
+/**
+ * The function is the body of the I/O thread of a handle. It waits for the sketch's output without
+ * blocking the callers, splits it into lines and interprets them, and writes the submitted commands
+ * as the robot gets through them, until the handle is closed or the port fails.
+ *
+ * @param arg The handle.
+ */
+static void *read_from_usb(void *arg)
+{
+    kp_handle *handle = (kp_handle *)arg;
+    struct pollfd pfds[2] = {{handle->fd, POLLIN, 0}, {handle->wake_fd, POLLIN, 0}};
+    char buf[256];
+    uint64_t wakes;
+    ssize_t num_read;
+
+    while (1)
+    {
+        pthread_mutex_lock(&handle->lock);
+        send_submission(handle);
+        if (handle->stopping)
+        {
+            pthread_mutex_unlock(&handle->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&handle->lock);
+
+        if (poll(pfds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        if (pfds[1].revents != 0 && read(handle->wake_fd, &wakes, sizeof(wakes)) == -1 && errno != EAGAIN)
+        {
+            break;
+        }
+        if (pfds[0].revents == 0)
+        {
+            continue;
+        }
+
+        num_read = read(handle->fd, buf, sizeof(buf));
+        if (num_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            continue;
+        }
+        // With VMIN and VTIME at 0 an empty read only means nothing is waiting, unless the port hung up
+        if (num_read == 0 && !(pfds[0].revents & (POLLHUP | POLLERR | POLLNVAL)))
+        {
+            continue;
+        }
+        if (num_read <= 0)
+        {
+            break;
+        }
 
-    close(fd);
+        pthread_mutex_lock(&handle->lock);
+        for (ssize_t i = 0; i < num_read; i++)
+        {
+            if (buf[i] == '\n')
+            {
+                handle->line[handle->line_len] = '\0';
+                parse_line(handle, handle->line);
+                handle->line_len = 0;
+            }
+            else if (buf[i] != '\r' && handle->line_len < KP_LINE_MAX - 1)
+            {
+                handle->line[handle->line_len++] = buf[i];
+            }
+        }
+        pthread_mutex_unlock(&handle->lock);
+    }
+
+    // Nothing sent or queued will ever be reported done
+    pthread_mutex_lock(&handle->lock);
+    handle->failed = 1;
+    drop_pending(handle, -EIO);
+    while (handle->submitted_count > 0)
+    {
+        complete(handle, handle->submitted[handle->submitted_head].cookie, -EIO);
+        handle->submitted_head = (handle->submitted_head + 1) % KP_SUBMIT_MAX;
+        handle->submitted_count--;
+    }
+    pthread_mutex_unlock(&handle->lock);
+    return NULL;
+}
+
+/**
+ * The function starts the I/O thread of a handle. It is called once the Arduino has booted, so the
+ * bootloader's output is not mistaken for the sketch's.
+ *
+ * @param handle The handle.
+ *
+ * @return 0 on success, -1 if the thread could not be started.
+ */
+static int start_reader(kp_handle *handle)
+{
+    pthread_condattr_t monotonic;
+
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+    pthread_cond_init(&handle->done, &monotonic);
+    pthread_condattr_destroy(&monotonic);
+
+    handle->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    handle->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (handle->event_fd == -1 || handle->wake_fd == -1)
+    {
+        return -1;
+    }
+
+    if (pthread_create(&handle->reader, NULL, read_from_usb, handle) != 0)
+    {
+        return -1;
+    }
+    handle->reading = 1;
     return 0;
 }
 
 /**
- * The function "set_size" checks if the input parameter is valid and writes it to a USB if it is.
+ * The function records that a command was sent and how many tokens the robot will report for it.
  *
- * @param size The parameter "size" is a pointer to a character array (string) that represents the size
- * of a physical symbols matrix. The function "set_size" takes this parameter and checks if it is equal to "s ", "m ",
- * or "b ". If it is, it calls the function "write_to_usb
+ * @param handle The open serial connection, with its write lock held.
+ * @param tokens The number of tokens in the command.
+ * @param async Whether the command was submitted with kp_submit().
+ * @param cookie The submitter's cookie.
  *
- * @return The function `set_size` returns an integer value. If the `size` parameter is equal to "s ",
- * "m ", or "b ", it calls the `write_to_usb` function with the `size` parameter and returns the value
- * returned by `write_to_usb`. If the `size` parameter is not equal to any of those values, it prints
- * an error message and returns -1
+ * @return The id of the command the tokens were added to, for unexpect_tokens().
  */
-int set_size(char *size)
+static unsigned long expect_tokens(kp_handle *handle, int tokens, int async, void *cookie)
 {
-    if (strcmp(size, "s") == 0 || strcmp(size, "m") == 0 || strcmp(size, "b") == 0)
+    struct kp_pending *pending;
+    unsigned long id;
+
+    pthread_mutex_lock(&handle->lock);
+    if (handle->pending_count == KP_PENDING_MAX)
     {
-        return write_to_usb(size, 3);
+        // Too many commands in flight: the newest one absorbs this one
+        pending = &handle->pending[(handle->pending_head + handle->pending_count - 1) % KP_PENDING_MAX];
+        pending->tokens += tokens;
     }
     else
     {
+        pending = &handle->pending[(handle->pending_head + handle->pending_count) % KP_PENDING_MAX];
+        pending->tokens = tokens;
+        pending->async = async;
+        pending->cookie = cookie;
+        pending->rejected = 0;
+        pending->id = ++handle->pending_id;
+        handle->pending_count++;
+    }
+    id = pending->id;
+    pthread_mutex_unlock(&handle->lock);
+    return id;
+}
+
+/**
+ * The function takes back the tokens of a command whose write failed. With the write lock still held
+ * they are the newest ones, but the robot may have finished or dropped commands meanwhile, and they
+ * may have been absorbed by an older command.
+ *
+ * @param handle The open serial connection, with its write lock held.
+ * @param id The id expect_tokens() returned.
+ * @param tokens The number of tokens in the command.
+ */
+static void unexpect_tokens(kp_handle *handle, unsigned long id, int tokens)
+{
+    struct kp_pending *pending;
+
+    pthread_mutex_lock(&handle->lock);
+    if (handle->pending_count > 0)
+    {
+        pending = &handle->pending[(handle->pending_head + handle->pending_count - 1) % KP_PENDING_MAX];
+
+        // Nothing left means the command was its own, or the one that absorbed it is done too
+        if (pending->id == id && (pending->tokens -= tokens) <= 0)
+        {
+            handle->pending_count--;
+            pthread_cond_broadcast(&handle->done);
+        }
+    }
+    pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * The function waits once for the Arduinos behind freshly opened handles to boot, then discards
+ * whatever their bootloaders sent meanwhile.
+ *
+ * @param handles The handles, some of which may be NULL.
+ * @param count The number of handles.
+ */
+static void wait_for_boot(kp_handle **handles, int count)
+{
+    struct timespec boot = {KP_BOOT_DELAY_MS / 1000, (KP_BOOT_DELAY_MS % 1000) * 1000000L};
+
+    nanosleep(&boot, NULL);
+    for (int i = 0; i < count; i++)
+    {
+        if (handles[i] != NULL)
+        {
+            tcflush(handles[i]->fd, TCIOFLUSH);
+        }
+    }
+}
+
+/**
+ * The function opens the serial port of the robot and configures it once, for the life of the handle.
+ * Opening the port raises DTR, which resets the Arduino, so it waits for the bootloader to hand over
+ * to the sketch and discards whatever was received meanwhile.
+ *
+ * @param path The serial device, or NULL for KP_DEFAULT_DEVICE.
+ *
+ * @return A handle to pass to the other kp_ functions, or NULL if the device could not be opened.
+ */
+kp_handle *kp_open(const char *path)
+{
+    kp_handle *handle = open_handle(path != NULL ? path : KP_DEFAULT_DEVICE);
+
+    if (handle != NULL)
+    {
+        wait_for_boot(&handle, 1);
+        if (start_reader(handle) == -1)
+        {
+            perror("Error: Starting the reader thread failed\n");
+        }
+    }
+    return handle;
+}
+
+/**
+ * The function closes the serial port and releases the handle.
+ *
+ * @param handle A handle returned by kp_open(), or NULL.
+ */
+void kp_close(kp_handle *handle)
+{
+    uint64_t one = 1;
+
+    if (handle == NULL)
+    {
+        return;
+    }
+
+    if (handle->reading)
+    {
+        pthread_mutex_lock(&handle->lock);
+        handle->stopping = 1;
+        pthread_mutex_unlock(&handle->lock);
+        if (write(handle->wake_fd, &one, sizeof(one)) == -1)
+        {
+            perror("Error: Stopping the I/O thread failed\n");
+        }
+        pthread_join(handle->reader, NULL);
+    }
+    if (handle->event_fd != -1)
+    {
+        close(handle->event_fd);
+    }
+    if (handle->wake_fd != -1)
+    {
+        close(handle->wake_fd);
+    }
+    close(handle->fd);
+    free(handle);
+}
+
+/**
+ * The function returns a file descriptor that becomes readable when submitted commands are over, for
+ * poll() or epoll. kp_poll_completions() collects them and clears it.
+ *
+ * @param handle The open serial connection.
+ *
+ * @return The file descriptor, or -1 if the robot's output is not being read.
+ */
+int kp_event_fd(kp_handle *handle)
+{
+    return handle != NULL && handle->reading ? handle->event_fd : -1;
+}
+
+/**
+ * The function returns how many commands were sent or submitted that the robot has not reported
+ * finished yet.
+ */
+int kp_pending(kp_handle *handle)
+{
+    int pending;
+
+    pthread_mutex_lock(&handle->lock);
+    pending = handle->pending_count + handle->submitted_count;
+    pthread_mutex_unlock(&handle->lock);
+    return pending;
+}
+
+/**
+ * The function blocks until the robot has finished every command sent or submitted to it, as reported
+ * by the sketch on the serial port.
+ *
+ * @param handle The open serial connection.
+ * @param timeout_ms The longest time to wait in milliseconds, or a negative number to wait forever.
+ *
+ * @return 0 once the robot is idle, -1 with errno set to ETIMEDOUT if it is still busy after the
+ *         timeout, ECONNRESET if it restarted and lost its work, EIO if the port failed, or EINVAL if
+ *         it is idle but rejected a command sent since the last call.
+ */
+int kp_wait_idle(kp_handle *handle, int timeout_ms)
+{
+    struct timespec deadline;
+    unsigned long resets;
+    int result = 0;
+
+    if (handle == NULL || !handle->reading)
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (deadline.tv_nsec + (timeout_ms % 1000) * 1000000L) / 1000000000L + timeout_ms / 1000;
+    deadline.tv_nsec = (deadline.tv_nsec + (timeout_ms % 1000) * 1000000L) % 1000000000L;
+
+    pthread_mutex_lock(&handle->lock);
+    resets = handle->resets;
+    while (handle->pending_count + handle->submitted_count > 0 && !handle->failed && handle->resets == resets &&
+           result == 0)
+    {
+        if (timeout_ms < 0)
+        {
+            pthread_cond_wait(&handle->done, &handle->lock);
+        }
+        else
+        {
+            result = pthread_cond_timedwait(&handle->done, &handle->lock, &deadline);
+        }
+    }
+
+    if (handle->failed)
+    {
+        errno = EIO;
+        result = -1;
+    }
+    else if (handle->resets != resets)
+    {
+        errno = ECONNRESET;
+        result = -1;
+    }
+    else if (handle->pending_count + handle->submitted_count > 0)
+    {
+        errno = ETIMEDOUT;
+        result = -1;
+    }
+    else if (handle->rejected)
+    {
+        handle->rejected = 0;
+        errno = EINVAL;
+        result = -1;
+    }
+    pthread_mutex_unlock(&handle->lock);
+
+    return result;
+}
+
+/**
+ * The function returns the handle used by the legacy API, opening KP_DEFAULT_DEVICE the first time
+ * it is needed. If that fails it is retried on the next call.
+ *
+ * @return The default handle, or NULL if the device could not be opened.
+ */
+static kp_handle *get_default_handle()
+{
+    kp_handle *handle;
+
+    pthread_mutex_lock(&default_handle_lock);
+    if (default_handle == NULL)
+    {
+        default_handle = kp_open(KP_DEFAULT_DEVICE);
+    }
+    handle = default_handle;
+    pthread_mutex_unlock(&default_handle_lock);
+
+    return handle;
+}
+
+/**
+ * The function writes a frame made of several pieces to the serial port with writev(), without
+ * copying them into one buffer. The port is non-blocking, so partial writes are resumed where they
+ * stopped and EAGAIN waits until the port can take more data.
+ *
+ * @param handle The open serial connection.
+ * @param iov The pieces of the frame. The array is consumed as the data is written.
+ * @param iovcnt The number of pieces.
+ *
+ * @return 0 once the whole frame is written, -1 if the write fails.
+ */
+static int write_to_usb(kp_handle *handle, struct iovec *iov, int iovcnt)
+{
+    struct pollfd pfd = {handle->fd, POLLOUT, 0};
+    ssize_t num_written;
+
+    while (iovcnt > 0)
+    {
+        num_written = writev(handle->fd, iov, iovcnt);
+        if (num_written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+                {
+                    perror("Error: Waiting for the driver file failed\n");
+                    return -1;
+                }
+                continue;
+            }
+            perror("Error: Writting to the driver file failed\n");
+            return -1;
+        }
+
+        // Skip what was written, possibly stopping in the middle of a piece
+        while (iovcnt > 0 && (size_t)num_written >= iov->iov_len)
+        {
+            num_written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + num_written;
+            iov->iov_len -= num_written;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * The function counts the tokens the sketch reports for a command: one for a size token and the
+ * unknown key that follows it, or for a calibration token, and otherwise the keys and the delete and
+ * enter keys around them.
+ */
+static int count_tokens(enum kp_command_type type, const char *text)
+{
+    int tokens = 2; // The delete and enter keys
+
+    if (type == KP_SET_SIZE || type == KP_CALIBRATE)
+    {
+        return 1;
+    }
+
+    for (const char *key = text; *key != '\0'; key++)
+    {
+        if (*key != ' ' && (key[1] == ' ' || key[1] == '\0'))
+        {
+            tokens++;
+        }
+    }
+    return tokens;
+}
+
+/**
+ * The function checks a command: a size must be "s", "m" or "b", and a calibration entry must name a
+ * size and a key, with angles the servos can reach, or a size and a row, with a press profile the
+ * sketch accepts.
+ *
+ * @return 0 if the command is valid, -1 otherwise.
+ */
+static int check_command(enum kp_command_type type, const char *text)
+{
+    char size, key, row;
+    int lr, fb, touch, used = 0;
+    int max_step, accel, tick_ms, slow_degrees, slow_ms;
+
+    if (type == KP_SET_SIZE)
+    {
+        if (strcmp(text, "s") == 0 || strcmp(text, "m") == 0 || strcmp(text, "b") == 0)
+        {
+            return 0;
+        }
         printf("Error: Invalid size parameter\n");
         return -1;
     }
+    if (type == KP_CALIBRATE)
+    {
+        if (strcmp(text, "w") == 0 || strcmp(text, "d") == 0)
+        {
+            return 0;
+        }
+        if (sscanf(text, "%c%c=%d,%d,%d%n", &size, &key, &lr, &fb, &touch, &used) == 5 &&
+            text[used] == '\0' && strchr("smb", size) != NULL && strchr("0123456789dr", key) != NULL &&
+            lr >= 0 && lr <= 180 && fb >= 0 && fb <= 180 && touch >= 0 && touch <= 100)
+        {
+            return 0;
+        }
+        if (sscanf(text, "p%c%c=%d,%d,%d,%d,%d%n", &size, &row, &max_step, &accel, &tick_ms, &slow_degrees,
+                   &slow_ms, &used) == 7 &&
+            text[used] == '\0' && strchr("smb", size) != NULL && row >= '0' && row <= '3' && max_step >= 1 &&
+            max_step <= 30 && accel >= 1 && accel <= max_step && tick_ms >= 1 && tick_ms <= 100 &&
+            slow_degrees >= 0 && slow_degrees <= 30 && slow_ms >= 1 && slow_ms <= 100)
+        {
+            return 0;
+        }
+        printf("Error: Invalid calibration entry\n");
+        return -1;
+    }
+    return type == KP_PRESS_KEYS ? 0 : -1;
+}
+
+/**
+ * The function writes a command to the robot as a single writev() with no allocation. A size is
+ * terminated by the newline the sketch matches size tokens with; the sketch prints nothing when a size
+ * change is over, so an unknown key follows it, which the sketch reports right after. Keys are framed
+ * by the delete and enter keys, and a calibration entry follows the letter that marks it.
+ *
+ * @param handle The open serial connection.
+ * @param type What the command does.
+ * @param text The size, or the space separated keys to be pressed.
+ * @param async Whether the command was submitted with kp_submit().
+ * @param cookie The submitter's cookie.
+ *
+ * @return 0 on success, -1 if the write fails.
+ */
+static int send_command(kp_handle *handle, enum kp_command_type type, const char *text, int async,
+                        void *cookie)
+{
+    struct iovec iov[3];
+    unsigned long id;
+    int tokens = count_tokens(type, text);
+
+    if (type == KP_SET_SIZE)
+    {
+        iov[0] = (struct iovec){(void *)text, 1};
+        iov[1] = (struct iovec){(void *)size_suffix, sizeof(size_suffix) - 1};
+        iov[2] = (struct iovec){(void *)size_sentinel, sizeof(size_sentinel) - 1};
+    }
+    else if (type == KP_CALIBRATE)
+    {
+        iov[0] = (struct iovec){(void *)calibrate_prefix, sizeof(calibrate_prefix) - 1};
+        iov[1] = (struct iovec){(void *)text, strlen(text)};
+        iov[2] = (struct iovec){(void *)token_suffix, sizeof(token_suffix) - 1};
+    }
+    else
+    {
+        iov[0] = (struct iovec){(void *)press_prefix, sizeof(press_prefix) - 1};
+        iov[1] = (struct iovec){(void *)text, strlen(text)};
+        iov[2] = (struct iovec){(void *)press_suffix, sizeof(press_suffix) - 1};
+    }
+
+    // The robot reports tokens in the order they reach the port, so commands are written one at a time
+    pthread_mutex_lock(&handle->write_lock);
+    id = expect_tokens(handle, tokens, async, cookie);
+    if (write_to_usb(handle, iov, 3) == -1)
+    {
+        unexpect_tokens(handle, id, tokens);
+        pthread_mutex_unlock(&handle->write_lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&handle->write_lock);
+    return 0;
+}
+
+/**
+ * The function "kp_set_size" checks if the input parameter is valid and writes it to the robot if it is.
+ *
+ * @param handle The open serial connection.
+ * @param size The size of the physical symbols matrix: "s", "m" or "b".
+ *
+ * @return 0 on success, -1 if the size is invalid or the write fails.
+ */
+int kp_set_size(kp_handle *handle, const char *size)
+{
+    if (handle == NULL || check_command(KP_SET_SIZE, size) == -1)
+    {
+        return -1;
+    }
+    return send_command(handle, KP_SET_SIZE, size, 0, NULL);
+}
+
+/**
+ * The function "kp_press_keys" writes a string of keys to the robot framed by the delete and enter
+ * keys.
+ *
+ * @param handle The open serial connection.
+ * @param keys The space separated keys to be pressed.
+ *
+ * @return 0 on success, -1 if the write fails.
+ */
+int kp_press_keys(kp_handle *handle, const char *keys)
+{
+    if (handle == NULL)
+    {
+        return -1;
+    }
+    return send_command(handle, KP_PRESS_KEYS, keys, 0, NULL);
 }
 
 /**
- * The function "press_keys" writes a string of keys to a USB device by adding a prefix and suffix to
- * the string and then calling the "write_to_usb" function.
+ * The function "kp_calibrate" writes an entry of the robot's calibration: the absolute angles of one
+ * key for one size, such as "s1=102,122,80", or the press profile of one row for one size, such as
+ * "ps3=4,1,6,4,6". "w" saves the calibration to the robot's EEPROM and "d" brings back the factory
+ * values. kp_wait_idle() tells when the robot has answered, and fails with EINVAL if it rejected the
+ * entry.
  *
- * @param keys The parameter "keys" is a pointer to a character array (string) that contains the keys
- * to be pressed.
+ * @param handle The open serial connection.
+ * @param entry The entry.
  *
- * @return an integer value, which is the result of calling the function `write_to_usb()` with the
- * concatenated string `result` as the input parameter.
+ * @return 0 on success, -1 if the entry is invalid or the write fails.
+ */
+int kp_calibrate(kp_handle *handle, const char *entry)
+{
+    if (handle == NULL || check_command(KP_CALIBRATE, entry) == -1)
+    {
+        return -1;
+    }
+    return send_command(handle, KP_CALIBRATE, entry, 0, NULL);
+}
+
+/**
+ * The function "kp_submit" queues a command for the robot and returns at once. The handle's I/O
+ * thread writes it when the robot is done with the commands before it, and once the robot reports it
+ * done its completion can be collected with kp_poll_completions().
+ *
+ * @param handle The open serial connection.
+ * @param cmd The command. Its text is copied.
+ * @param cookie Returned with the completion, to tell commands apart.
+ *
+ * @return 0 on success, -1 with errno set to EINVAL if the command is invalid, EAGAIN if
+ *         KP_SUBMIT_MAX completions are already outstanding, or EIO if the port failed.
+ */
+int kp_submit(kp_handle *handle, const struct kp_command *cmd, void *cookie)
+{
+    struct kp_submission *submission;
+    uint64_t one = 1;
+
+    if (handle == NULL || !handle->reading || cmd == NULL || cmd->text == NULL ||
+        strlen(cmd->text) >= KP_COMMAND_MAX || check_command(cmd->type, cmd->text) == -1)
+    {
+        errno = handle == NULL || !handle->reading ? EIO : EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&handle->lock);
+    if (handle->failed || handle->outstanding == KP_SUBMIT_MAX)
+    {
+        errno = handle->failed ? EIO : EAGAIN;
+        pthread_mutex_unlock(&handle->lock);
+        return -1;
+    }
+
+    submission = &handle->submitted[(handle->submitted_head + handle->submitted_count) % KP_SUBMIT_MAX];
+    submission->type = cmd->type;
+    strcpy(submission->text, cmd->text);
+    submission->cookie = cookie;
+    handle->submitted_count++;
+    handle->outstanding++;
+    pthread_mutex_unlock(&handle->lock);
+
+    if (write(handle->wake_fd, &one, sizeof(one)) == -1)
+    {
+        perror("Error: Waking the I/O thread failed\n");
+    }
+    return 0;
+}
+
+/**
+ * The function "kp_poll_completions" collects the completions of submitted commands without blocking,
+ * oldest first. Once all are collected the event file descriptor is no longer readable.
+ *
+ * @param handle The open serial connection.
+ * @param events Receives the completions.
+ * @param max The room in events.
+ *
+ * @return The number of completions collected, 0 if there are none.
+ */
+int kp_poll_completions(kp_handle *handle, struct kp_completion *events, int max)
+{
+    uint64_t count;
+    uint64_t one = 1;
+    int collected = 0;
+
+    if (handle == NULL || !handle->reading)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&handle->lock);
+    while (collected < max && handle->completions_count > 0)
+    {
+        events[collected++] = handle->completions[handle->completions_head];
+        handle->completions_head = (handle->completions_head + 1) % KP_SUBMIT_MAX;
+        handle->completions_count--;
+    }
+    handle->outstanding -= collected;
+
+    // The counter is cleared, and set again if completions are left
+    if (read(handle->event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    {
+        perror("Error: Clearing the completions failed\n");
+    }
+    if (handle->completions_count > 0 && write(handle->event_fd, &one, sizeof(one)) == -1)
+    {
+        perror("Error: Signaling a completion failed\n");
+    }
+    pthread_mutex_unlock(&handle->lock);
+
+    return collected;
+}
+
+/**
+ * The function "set_size" changes the size on the default device, which stays open for the life of
+ * the process, and prints what was sent. The kp_ functions print nothing.
+ *
+ * @param size The size of the physical symbols matrix: "s", "m" or "b".
+ *
+ * @return 0 on success, -1 if the size is invalid or the write fails.
+ */
+int set_size(char *size)
+{
+    if (kp_set_size(get_default_handle(), size) == -1)
+    {
+        return -1;
+    }
+
+    printf("\033[1;37m  ⭐ data sent  \033[0m");
+    printf("\033[0;30m%s\033[0m\n", size);
+    return 0;
+}
+
+/**
+ * The function "press_keys" presses keys on the default device, which stays open for the life of
+ * the process, and prints what was sent.
+ *
+ * @param keys The space separated keys to be pressed.
+ *
+ * @return 0 on success, -1 if the write fails.
  */
 int press_keys(char *keys)
 {
+    if (kp_press_keys(get_default_handle(), keys) == -1)
+    {
+        return -1;
+    }
 
-    int res;
+    printf("\033[1;37m  ⭐ data sent  \033[0m");
+    printf("\033[0;30m%s%s%s\033[0m\n", press_prefix, keys, press_suffix);
+    return 0;
+}
 
-    char *prefix = "d ";
-    char *suffix = "r ";
+/**
+ * The function adds a device path to a pool being built, ignoring duplicates.
+ *
+ * @param pool The pool.
+ * @param path The serial device.
+ *
+ * @return 0 on success, -1 if the pool is full or memory ran out.
+ */
+static int pool_add_path(kp_pool *pool, const char *path)
+{
+    for (int i = 0; i < pool->count; i++)
+    {
+        if (strcmp(pool->paths[i], path) == 0)
+        {
+            return 0;
+        }
+    }
 
-    size_t write_data_len = strlen(keys);
-    size_t prefix_len = strlen(prefix);
-    size_t suffix_len = strlen(suffix);
+    if (pool->count == KP_POOL_MAX)
+    {
+        return -1;
+    }
 
-    size_t result_len = write_data_len + prefix_len + suffix_len + 1; // +1 for the null terminator
-    char *result = (char *)malloc(result_len);
+    pool->paths[pool->count] = strdup(path);
+    if (pool->paths[pool->count] == NULL)
+    {
+        return -1;
+    }
+    pool->count++;
+    return 0;
+}
+
+/**
+ * The function opens every robot of a pool. The spec is a comma separated list of serial devices;
+ * entries with wildcards, such as "/dev/ttyUSB*", are expanded to the devices that exist. All ports
+ * are opened before waiting, so the Arduinos boot in parallel. Devices that cannot be opened stay in
+ * the pool with no handle and can be retried with kp_pool_reopen().
+ *
+ * @param spec The devices, for example "/dev/ttyUSB0,/dev/ttyUSB1" or "/dev/ttyUSB*".
+ *
+ * @return The pool, or NULL if the spec names no device.
+ */
+kp_pool *kp_pool_open(const char *spec)
+{
+    kp_pool *pool;
+    char *copy;
+    char *entry;
+    char *saveptr;
+    glob_t matches;
+
+    pool = (kp_pool *)calloc(1, sizeof(kp_pool));
+    copy = strdup(spec != NULL ? spec : KP_DEFAULT_DEVICE);
+    if (pool == NULL || copy == NULL)
+    {
+        free(pool);
+        free(copy);
+        return NULL;
+    }
+    pool->paths = (char **)calloc(KP_POOL_MAX, sizeof(char *));
+    pool->handles = (kp_handle **)calloc(KP_POOL_MAX, sizeof(kp_handle *));
+
+    for (entry = strtok_r(copy, ",", &saveptr); entry != NULL && pool->paths != NULL; entry = strtok_r(NULL, ",", &saveptr))
+    {
+        if (strpbrk(entry, "*?[") == NULL)
+        {
+            pool_add_path(pool, entry);
+            continue;
+        }
+
+        if (glob(entry, 0, NULL, &matches) == 0)
+        {
+            for (size_t i = 0; i < matches.gl_pathc; i++)
+            {
+                pool_add_path(pool, matches.gl_pathv[i]);
+            }
+            globfree(&matches);
+        }
+    }
+    free(copy);
+
+    if (pool->count == 0 || pool->handles == NULL)
+    {
+        kp_pool_close(pool);
+        return NULL;
+    }
+
+    for (int i = 0; i < pool->count; i++)
+    {
+        pool->handles[i] = open_handle(pool->paths[i]);
+    }
+    wait_for_boot(pool->handles, pool->count);
+    for (int i = 0; i < pool->count; i++)
+    {
+        if (pool->handles[i] != NULL && start_reader(pool->handles[i]) == -1)
+        {
+            perror("Error: Starting the reader thread failed\n");
+        }
+    }
+
+    return pool;
+}
+
+/**
+ * The function closes every robot of a pool and releases it.
+ *
+ * @param pool A pool returned by kp_pool_open(), or NULL.
+ */
+void kp_pool_close(kp_pool *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
 
-    strcpy(result, prefix);
-    strcat(result, keys);
-    strcat(result, suffix);
+    for (int i = 0; i < pool->count; i++)
+    {
+        kp_close(pool->handles[i]);
+        free(pool->paths[i]);
+    }
+    free(pool->handles);
+    free(pool->paths);
+    free(pool);
+}
 
-    res = write_to_usb(result, result_len);
+/**
+ * The function returns the number of robots in a pool.
+ */
+int kp_pool_size(const kp_pool *pool)
+{
+    return pool->count;
+}
 
-    free(result);
+/**
+ * The function returns the serial device of one robot of a pool.
+ */
+const char *kp_pool_path(const kp_pool *pool, int index)
+{
+    return pool->paths[index];
+}
 
-    return res;
-}
\ No newline at end of file
+/**
+ * The function returns the handle of one robot of a pool.
+ *
+ * @return The handle, or NULL if the robot is unavailable.
+ */
+kp_handle *kp_pool_get(kp_pool *pool, int index)
+{
+    return pool->handles[index];
+}
+
+/**
+ * The function closes and opens again one robot of a pool, for example after a failed write.
+ *
+ * @return The new handle, or NULL if the robot is still unavailable.
+ */
+kp_handle *kp_pool_reopen(kp_pool *pool, int index)
+{
+    kp_close(pool->handles[index]);
+    pool->handles[index] = kp_open(pool->paths[index]);
+    return pool->handles[index];
+}
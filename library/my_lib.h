@@ -1,6 +1,52 @@
 #ifndef MY_LIB_H
 #define MY_LIB_H
 
+#define KP_DEFAULT_DEVICE "/dev/ttyUSB0"
+#define KP_POOL_MAX 32
+#define KP_COMMAND_MAX 256
+
+enum kp_command_type
+{
+    KP_SET_SIZE,   // text is "s", "m" or "b"
+    KP_PRESS_KEYS, // text is the space separated keys
+    KP_CALIBRATE   // text is "<size><key>=<lr>,<fb>,<touch>",
+                   // "p<size><row>=<max_step>,<accel>,<tick_ms>,<slow_degrees>,<slow_ms>",
+                   // "w" to save the table or "d" for the defaults
+};
+
+struct kp_command
+{
+    enum kp_command_type type;
+    const char *text;
+};
+
+struct kp_completion
+{
+    void *cookie; // As given to kp_submit()
+    int status;   // 0 once the robot finished the command, -EINVAL if it rejected it, otherwise a negative errno value
+};
+
+typedef struct kp_handle kp_handle;
+typedef struct kp_pool kp_pool;
+
+kp_handle *kp_open(const char *path);
+void kp_close(kp_handle *handle);
+int kp_set_size(kp_handle *handle, const char *size);
+int kp_press_keys(kp_handle *handle, const char *keys);
+int kp_calibrate(kp_handle *handle, const char *entry);
+int kp_event_fd(kp_handle *handle);
+int kp_pending(kp_handle *handle);
+int kp_wait_idle(kp_handle *handle, int timeout_ms);
+int kp_submit(kp_handle *handle, const struct kp_command *cmd, void *cookie);
+int kp_poll_completions(kp_handle *handle, struct kp_completion *events, int max);
+
+kp_pool *kp_pool_open(const char *spec);
+void kp_pool_close(kp_pool *pool);
+int kp_pool_size(const kp_pool *pool);
+const char *kp_pool_path(const kp_pool *pool, int index);
+kp_handle *kp_pool_get(kp_pool *pool, int index);
+kp_handle *kp_pool_reopen(kp_pool *pool, int index);
+
 int set_size(char* size);
 int press_keys(char* keys);
 
@@ -0,0 +1,40 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+/* *********************************
+    Test helpers
+************************************ */
+
+static int check_failures; // Checks that failed so far
+
+/**
+ * @brief Records a check, printing it if it failed.
+ */
+#define check(cond, name)                                                   \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            printf("⛔ %s:%d %s: %s\n", __FILE__, __LINE__, (name), #cond); \
+            check_failures++;                                               \
+        }                                                                   \
+    } while (0)
+
+/**
+ * @brief Prints the outcome of a test program.
+ * @return The exit status: 0 if every check passed, 1 otherwise.
+ */
+static int check_report(const char *program)
+{
+    if (check_failures > 0)
+    {
+        printf("⛔ %s: %d checks failed\n", program, check_failures);
+        return 1;
+    }
+    printf("✔ %s\n", program);
+    return 0;
+}
+
+#endif // CHECK_H
@@ -0,0 +1,75 @@
+#include "check.h"
+#include "../client-server/stats.c"
+#include "../client-server/clients.c"
+
+/**
+ * A datagram from a client and whether it should be taken for a duplicate. Steps run
+ * in order; those that are new get marked, like the server does once it accepts them.
+ */
+struct step
+{
+    const char *name;       // Step name, printed on failure
+    uint16_t port;          // Client port, so steps can come from different clients
+    uint32_t session;       // Session of the datagram
+    uint32_t seq;           // Sequence number of the datagram
+    int seen;               // Expected clients_seen() result
+};
+
+static const struct step steps[] = {
+    {"first", 1, 1, 0, 0},
+    {"resent", 1, 1, 0, 1},
+    {"next", 1, 1, 1, 0},
+    {"gap", 1, 1, 5, 0},
+    {"late", 1, 1, 3, 0},
+    {"late resent", 1, 1, 3, 1},
+    {"gap filled", 1, 1, 2, 0},
+    {"gap resent", 1, 1, 2, 1},
+    {"jump", 1, 1, 100, 0},
+    {"window edge", 1, 1, 37, 0},
+    {"window edge resent", 1, 1, 37, 1},
+    {"too old", 1, 1, 36, 1},
+    {"other client", 2, 1, 0, 0},
+    {"new session", 1, 2, 0, 0},
+    {"new session resent", 1, 2, 0, 1},
+    {"earlier session", 1, 1, 101, 1},
+    {"earlier session resent", 1, 1, 100, 1},
+    {"window kept", 1, 2, 0, 1},
+    {"third session", 1, 3, 0, 0},
+    {"second session late", 1, 2, 1, 1},
+    {"fourth session", 1, 4, 0, 0},
+    {"fifth session", 1, 5, 0, 0},
+    {"first session still retired", 1, 1, 500, 1},
+    {"sixth session", 1, 6, 0, 0},
+    {"first session forgotten", 1, 1, 500, 0},
+    {"wrap", 3, 9, 0xffffffff, 0},
+    {"wrapped", 3, 9, 0, 0},
+    {"before wrap resent", 3, 9, 0xffffffff, 1},
+    {"after wrap", 3, 9, 1, 0},
+};
+
+/**
+ * @brief Entry point of the deduplication window tests.
+ * @return 0 if every check passed, 1 otherwise.
+ */
+int main()
+{
+    struct sockaddr_in addr = {0};
+    const struct step *step;
+    int seen;
+
+    stats = &stats_fallback;
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++)
+    {
+        step = &steps[i];
+        addr.sin_port = htons(step->port);
+        seen = clients_seen(&addr, step->session, step->seq);
+        check(seen == step->seen, step->name);
+        if (!seen)
+            clients_mark(&addr, step->session, step->seq);
+    }
+
+    return check_report("test_clients");
+}
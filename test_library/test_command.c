@@ -0,0 +1,111 @@
+#include <string.h>
+
+#include "check.h"
+#include "../client-server/proto.c"
+#include "../client-server/command.c"
+
+/**
+ * A datagram for command_parse() and what it should become.
+ */
+struct parse_case
+{
+    const char *text;       // Plain text, encrypted before parsing
+    int result;             // Expected return value
+    enum command_type type; // Expected type
+    const char *keys;       // Expected keys, when result is 0
+};
+
+static const struct parse_case parse_cases[] = {
+    {"1234", 0, CMD_KEYS, "1 2 3 4 "},
+    {"1 2-3\n", 0, CMD_KEYS, "1 2 3 "},
+    {"m", 0, CMD_SIZE, "m"},
+    {"s\n", 0, CMD_SIZE, "s"},
+    {"b12", 0, CMD_SIZE, "b"},
+    {"a1", 0, CMD_KEYS, "1 "},
+    {"x", -1, CMD_INVALID, NULL},
+    {"sm", -1, CMD_INVALID, NULL},
+    {"S", -1, CMD_INVALID, NULL},
+    {"", -1, CMD_INVALID, NULL},
+};
+
+/**
+ * An operation for command_from_op() and what it should become.
+ */
+struct op_case
+{
+    uint8_t opcode;         // Operation opcode
+    const char *data;       // Operation payload
+    size_t len;             // Its length
+    int result;             // Expected return value
+    const char *keys;       // Expected keys, when result is 0
+};
+
+static const struct op_case op_cases[] = {
+    {PROTO_SET_SIZE, "\x00", 1, 0, "s"},
+    {PROTO_SET_SIZE, "\x02", 1, 0, "b"},
+    {PROTO_SET_SIZE, "\x03", 1, -1, NULL},
+    {PROTO_SET_SIZE, "\x01\x01", 2, -1, NULL},
+    {PROTO_PRESS, "\x01\x00\x09", 3, 0, "1 0 9 "},
+    {PROTO_PRESS, "\x0a", 1, -1, NULL},
+    {PROTO_PRESS, "", 0, -1, NULL},
+    {PROTO_PING, "\x01", 1, -1, NULL},
+};
+
+static struct command cmd;
+static char datagram[4096];
+
+/**
+ * @brief Encrypts a text with ROT128 into datagram.
+ * @return Its length.
+ */
+static size_t encrypt(const char *text)
+{
+    size_t len = strlen(text);
+
+    for (size_t i = 0; i < len; i++)
+        datagram[i] = text[i] ^ 0x80;
+    return len;
+}
+
+/**
+ * @brief Entry point of the command parser tests.
+ * @return 0 if every check passed, 1 otherwise.
+ */
+int main()
+{
+    const struct parse_case *pc;
+    const struct op_case *oc;
+    size_t len;
+
+    for (size_t i = 0; i < sizeof(parse_cases) / sizeof(parse_cases[0]); i++)
+    {
+        pc = &parse_cases[i];
+        len = encrypt(pc->text);
+        check(command_parse(datagram, len, &cmd) == pc->result, pc->text);
+        check(cmd.type == pc->type, pc->text);
+        if (pc->keys != NULL)
+        {
+            check(strcmp(cmd.keys, pc->keys) == 0, pc->text);
+            check(cmd.len == (int)strlen(pc->keys), pc->text);
+        }
+    }
+
+    // More keys than a command holds are dropped, not written past the buffer
+    memset(datagram, '7' ^ 0x80, sizeof(datagram));
+    check(command_parse(datagram, sizeof(datagram), &cmd) == 0, "too many keys");
+    check(cmd.len == 2 * COMMAND_MAX_KEYS, "too many keys");
+
+    for (size_t i = 0; i < sizeof(op_cases) / sizeof(op_cases[0]); i++)
+    {
+        oc = &op_cases[i];
+        check(command_from_op(oc->opcode, oc->data, oc->len, &cmd) == oc->result, "command_from_op");
+        if (oc->keys != NULL)
+            check(strcmp(cmd.keys, oc->keys) == 0, "command_from_op");
+    }
+
+    memset(datagram, 1, COMMAND_MAX_KEYS + 1);
+    check(command_from_op(PROTO_PRESS, datagram, COMMAND_MAX_KEYS, &cmd) == 0, "most keys");
+    check(command_from_op(PROTO_PRESS, datagram, COMMAND_MAX_KEYS + 1, &cmd) == -1, "too many keys");
+
+    return check_report("test_command");
+}
@@ -0,0 +1,139 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+
+#define LOG_LEVEL 0 // Nothing to log: the logger thread is not started
+
+#include "check.h"
+#include "../client-server/colors.h"
+#include "../client-server/log.c"
+#include "../client-server/stats.c"
+#include "../client-server/proto.c"
+#include "../client-server/command.c"
+#include "../client-server/model.c"
+#include "../client-server/device.c"
+
+#define TEST_DEPTH 32 // Admission depth the tests run with
+
+/**
+ * @brief Sets up one robot queue like device_start() does, without opening a port or
+ *        starting its consumer thread, so the tests drive the queue by hand.
+ */
+static void setup(int admit_depth, const char *weights)
+{
+    struct command key = {CMD_KEYS, "5 ", 2};
+
+    stats = &stats_fallback;
+    device_count = 1;
+    devices = (struct device_queue *)calloc(device_count, sizeof(struct device_queue));
+    device_model = model_default();
+    device_quantum_ms = DEVICE_QUANTUM_KEYS * model_estimate(&device_model, &key) / 3;
+    if (device_quantum_ms < 1)
+        device_quantum_ms = 1;
+    device_admit_depth = admit_depth;
+    device_set_weights(weights);
+
+    devices[0].active_head = -1;
+    devices[0].active_tail = -1;
+    pthread_mutex_init(&devices[0].lock, NULL);
+    pthread_cond_init(&devices[0].not_empty, NULL);
+}
+
+/**
+ * @brief Fills a one-key command from the client at 127.0.0.1:port.
+ */
+static void key_from(struct device_cmd *cmd, uint16_t port)
+{
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->command.type = CMD_KEYS;
+    strcpy(cmd->command.keys, "5 ");
+    cmd->command.len = 2;
+    cmd->addr.sin_family = AF_INET;
+    cmd->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    cmd->addr.sin_port = htons(port);
+    cmd->received_ns = stats_now();
+}
+
+/**
+ * @brief Checks that a client is admitted up to the depth and no further, and that it
+ *        is told to wait longer the more clients share the robot.
+ */
+static void test_admit(void)
+{
+    struct device_queue *device;
+    struct device_cmd one, two;
+    long hold, retry;
+
+    setup(4, "");
+    key_from(&one, 1);
+    key_from(&two, 2);
+    device = device_pick(&one);
+    hold = device_hold_ms(&one);
+    check(hold > 0, "estimate");
+
+    check(device_admit(device, &one, 5) == -1, "batch over the depth");
+    check(device_admit(device, &one, 4) == 0, "batch at the depth");
+    for (int i = 0; i < 4; i++)
+        check(device_push(device, &one) == 0, "push");
+    check(device_push(device, &one) == -1, "push over the depth");
+    check(device->count == 4, "push over the depth");
+
+    // One command over: the client waits for one of its own, and it has the robot alone
+    retry = device_admit(device, &one, 1);
+    check(retry == hold, "retry alone");
+    check(device_admit(device, &two, 4) == 0, "other client");
+
+    // Two over, with a second client of the same weight: twice the commands at half the share
+    check(device_push(device, &two) == 0, "other client push");
+    retry = device_admit(device, &one, 2);
+    check(retry == 4 * hold, "retry shared");
+}
+
+/**
+ * @brief Serves the robot queue like the consumer thread does and checks that two
+ *        busy clients get it in proportion to their weights.
+ */
+static void test_share(void)
+{
+    struct device_queue *device;
+    struct device_flow *flow;
+    struct device_cmd cmd;
+    int served[2] = {0, 0};
+    int rounds = 40;
+
+    setup(TEST_DEPTH, "127.0.0.1:1=3");
+    key_from(&cmd, 1);
+    device = device_pick(&cmd);
+    for (int i = 0; i < TEST_DEPTH; i++)
+    {
+        key_from(&cmd, 1);
+        device_push(device, &cmd);
+        key_from(&cmd, 2);
+        device_push(device, &cmd);
+    }
+    check(device->count == 2 * TEST_DEPTH, "queued");
+    check(device->active_weight == 4, "active weight");
+
+    for (int i = 0; i < rounds; i++)
+    {
+        flow = device_next(device);
+        device_take(device, flow, &cmd);
+        flow->deficit -= device_hold_ms(&cmd);
+        served[ntohs(cmd.addr.sin_port) - 1]++;
+    }
+
+    // Three commands of the heavier client for each of the other, give or take a round
+    check(abs(served[0] - 3 * served[1]) <= 2 * DEVICE_QUANTUM_KEYS, "weighted share");
+    check(served[0] + served[1] == rounds, "every pick served");
+    check(device->count == 2 * TEST_DEPTH - rounds, "taken");
+}
+
+/**
+ * @brief Entry point of the robot queue tests.
+ * @return 0 if every check passed, 1 otherwise.
+ */
+int main()
+{
+    test_admit();
+    test_share();
+    return check_report("test_device");
+}
@@ -0,0 +1,133 @@
+#include <string.h>
+
+#include "check.h"
+#include "../client-server/proto.c"
+
+/**
+ * A frame payload for proto_next_op() and how it should be walked.
+ */
+struct op_case
+{
+    const char *name;       // Case name, printed on failure
+    uint8_t opcode;         // Frame opcode
+    const char *payload;    // Frame payload
+    uint16_t length;        // Its length
+    int ops;                // Operations read before the last result
+    int last;               // Expected last result: 0 at the end, -1 if malformed
+};
+
+static const struct op_case op_cases[] = {
+    {"press", PROTO_PRESS, "\x01\x02\x03", 3, 1, 0},
+    {"set size", PROTO_SET_SIZE, "\x01", 1, 1, 0},
+    {"empty batch", PROTO_BATCH, "", 0, 0, 0},
+    {"batch", PROTO_BATCH, "\x01\x02\x05\x06\x02\x01\x02", 7, 2, 0},
+    {"empty op", PROTO_BATCH, "\x01\x00\x02\x01\x00", 5, 2, 0},
+    {"cut header", PROTO_BATCH, "\x01\x01\x05\x02", 4, 1, -1},
+    {"cut payload", PROTO_BATCH, "\x01\x03\x05\x06", 4, 0, -1},
+    {"bad opcode", PROTO_BATCH, "\x01\x01\x05\x04\x00", 5, 1, -1},
+    {"nested batch", PROTO_BATCH, "\x03\x00", 2, 0, -1},
+};
+
+static char frame[PROTO_HEADER_SIZE + PROTO_MAX_PAYLOAD + 1];
+
+/**
+ * @brief Checks the CRC-32 against the standard check value.
+ */
+static void test_crc32(void)
+{
+    check(proto_crc32(0, "123456789", 9) == 0xCBF43926, "crc32");
+    check(proto_crc32(proto_crc32(0, "1234", 4), "56789", 5) == 0xCBF43926, "crc32 in parts");
+    check(proto_crc32(0, "", 0) == 0, "crc32 of nothing");
+}
+
+/**
+ * @brief Checks that an encoded frame decodes to the same header, and that damaged
+ *        frames and legacy datagrams are told apart.
+ */
+static void test_decode(void)
+{
+    struct proto_header header = {0}, decoded;
+    size_t len;
+
+    header.opcode = PROTO_PRESS;
+    header.session = 0xdeadbeef;
+    header.seq = 70000;
+    header.length = 3;
+    header.ttl = 500;
+    len = proto_encode(frame, &header, "\x81\x82\x83");
+
+    check(len == PROTO_HEADER_SIZE + 3, "encode");
+    check(proto_decode(frame, len, &decoded) == PROTO_HEADER_SIZE, "decode");
+    check(decoded.opcode == PROTO_PRESS, "decode");
+    check(decoded.session == 0xdeadbeef, "decode");
+    check(decoded.seq == 70000, "decode");
+    check(decoded.length == 3, "decode");
+    check(decoded.ttl == 500, "decode");
+    check(memcmp(frame + PROTO_HEADER_SIZE, "\x81\x82\x83", 3) == 0, "decode");
+
+    check(proto_decode(frame, len - 1, &decoded) == PROTO_CORRUPT, "short frame");
+    check(proto_decode(frame, len + 1, &decoded) == PROTO_CORRUPT, "long frame");
+    check(proto_decode(frame, PROTO_HEADER_SIZE - 1, &decoded) == PROTO_LEGACY, "short datagram");
+
+    frame[PROTO_HEADER_SIZE + 1] ^= 0x01;
+    check(proto_decode(frame, len, &decoded) == PROTO_CORRUPT, "flipped payload bit");
+    frame[PROTO_HEADER_SIZE + 1] ^= 0x01;
+    frame[9] ^= 0x10;
+    check(proto_decode(frame, len, &decoded) == PROTO_CORRUPT, "flipped header bit");
+    frame[9] ^= 0x10;
+
+    frame[1] = PROTO_VERSION + 1;
+    check(proto_decode(frame, len, &decoded) == PROTO_CORRUPT, "unknown version");
+    frame[1] = PROTO_VERSION;
+
+    frame[0] = '1' ^ 0x80;
+    check(proto_decode(frame, len, &decoded) == PROTO_LEGACY, "legacy datagram");
+    frame[0] = (char)PROTO_MAGIC;
+    check(proto_decode(frame, len, &decoded) == PROTO_HEADER_SIZE, "restored frame");
+
+    header.length = PROTO_MAX_PAYLOAD + 1;
+    memset(frame + PROTO_HEADER_SIZE, 0, PROTO_MAX_PAYLOAD + 1);
+    len = proto_encode(frame, &header, frame + PROTO_HEADER_SIZE);
+    check(proto_decode(frame, len, &decoded) == PROTO_CORRUPT, "oversized payload");
+}
+
+/**
+ * @brief Walks every op_cases payload with proto_next_op().
+ */
+static void test_next_op(void)
+{
+    struct proto_header header = {0};
+    const struct op_case *oc;
+    const char *op;
+    size_t offset, op_len;
+    uint8_t opcode;
+    int result, ops;
+
+    for (size_t i = 0; i < sizeof(op_cases) / sizeof(op_cases[0]); i++)
+    {
+        oc = &op_cases[i];
+        header.opcode = oc->opcode;
+        header.length = oc->length;
+        offset = 0;
+        ops = 0;
+        while ((result = proto_next_op(&header, oc->payload, &offset, &opcode, &op, &op_len)) == 1)
+        {
+            check(op >= oc->payload && op + op_len <= oc->payload + oc->length, oc->name);
+            ops++;
+        }
+        check(ops == oc->ops, oc->name);
+        check(result == oc->last, oc->name);
+    }
+}
+
+/**
+ * @brief Entry point of the frame tests.
+ * @return 0 if every check passed, 1 otherwise.
+ */
+int main()
+{
+    test_crc32();
+    test_decode();
+    test_next_op();
+    return check_report("test_proto");
+}